@@ -0,0 +1,311 @@
+// Micro-benchmarks of the simulator's hot primitives, each timed on its own.
+// Usage: quick_sim_bench [name substring]
+// Every benchmark prints ns/op and allocations/op. Allocations are heap
+// allocations through operator new plus GMP's allocation and reallocation
+// hooks, which is where big integer limbs come from.
+#include "flight_recorder.h"
+#include "limb_allocator.h"
+#include "prover.h"
+#include "simulator.h"
+#include "tape.h"
+#include "turing_machine.h"
+#include "x_integer.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <gmp.h>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+std::atomic<long long> num_allocs=0;
+
+void* operator new(size_t size) {
+    num_allocs.fetch_add(1,std::memory_order_relaxed);
+    if (void* p=malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept {
+    free(p);
+}
+void operator delete(void* p,size_t) noexcept {
+    free(p);
+}
+
+// Wrap whatever GMP allocates with (the limb pool, unless disabled).
+void* (*gmp_alloc)(size_t);
+void* (*gmp_realloc)(void*,size_t,size_t);
+void (*gmp_free)(void*,size_t);
+
+void* counting_gmp_alloc(size_t size) {
+    num_allocs.fetch_add(1,std::memory_order_relaxed);
+    return gmp_alloc(size);
+}
+void* counting_gmp_realloc(void* p,size_t old_size,size_t size) {
+    num_allocs.fetch_add(1,std::memory_order_relaxed);
+    return gmp_realloc(p,old_size,size);
+}
+void counting_gmp_free(void* p,size_t size) {
+    gmp_free(p,size);
+}
+
+const char* filter=nullptr;
+const long long MIN_NS=200000000; // time each benchmark for at least this long
+
+long long bench_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Time op(i) for i<n, doubling n until it takes MIN_NS. setup(n) runs first,
+// untimed, for ops that consume their input. max_ops bounds what setup makes.
+void bench(const std::string& name,std::function<void(long long)> setup,std::function<void(long long)> op,long long max_ops=1<<24) {
+    if (filter && name.find(filter)==std::string::npos) return;
+    for (long long n=1; ; n*=2) {
+        setup(n);
+        long long allocs=num_allocs;
+        long long start=bench_now_ns();
+        for (long long i=0; i<n; i++) op(i);
+        long long elapsed=bench_now_ns()-start;
+        allocs=num_allocs-allocs;
+        if (elapsed>=MIN_NS || 2*n>max_ops) {
+            printf("%-44s %14.1f ns/op %10.2f allocs/op\n",name.c_str(),(double)elapsed/n,(double)allocs/n);
+            fflush(stdout);
+            return;
+        }
+    }
+}
+
+void bench(const std::string& name,std::function<void()> op) {
+    bench(name,[](long long) {},[&op](long long) {op();});
+}
+
+// Keep the compiler from dropping a result.
+template<class T>
+void keep(const T& x) {
+    asm volatile("" : : "g"(&x) : "memory");
+}
+
+// A pseudo-random number with `digits` decimal digits.
+XInteger random_xinteger(long long digits,unsigned long long seed) {
+    std::string s(digits,'0');
+    for (long long i=0; i<digits; i++) {
+        seed=seed*6364136223846793005ULL+1442695040888963407ULL;
+        s[i]='0'+(seed>>33)%10;
+    }
+    if (s[0]=='0') s[0]='1';
+    fmpz_class x;
+    fmpz_set_str(x.num,s.c_str(),10);
+    return {x};
+}
+
+struct Size {
+    std::string name;
+    long long digits;
+};
+const std::vector<Size> SIZES={{"small",1},{"64bit",19},{"1e3",1000},{"1e6",1000000}};
+
+void bench_xinteger() {
+    for (const Size& size:SIZES) {
+        XInteger a=random_xinteger(size.digits,1),b=random_xinteger(size.digits,2);
+        XInteger sum=a+b,product=a*b,c;
+        bench("XInteger add "+size.name,[&]() {c=a+b; keep(c);});
+        bench("XInteger sub "+size.name,[&]() {c=sum-b; keep(c);});
+        bench("XInteger mul "+size.name,[&]() {c=a*b; keep(c);});
+        bench("XInteger div "+size.name,[&]() {c=product/b; keep(c);});
+        bench("XInteger += "+size.name,[&]() {c=a; c+=b; keep(c);});
+    }
+}
+
+void bench_chain_tape() {
+    for (const Size& size:SIZES) {
+        // Bounce the head inside a long run of 1s, so the tape keeps its shape.
+        ChainTape tape(0,RIGHT);
+        XInteger count=random_xinteger(std::max(size.digits,2LL),3);
+        for (auto& half:tape.tape) half.push_back({1,count});
+        bench("ChainTape::apply_single_move "+size.name,[&]() {
+            tape.apply_single_move(1,tape.dir);
+            tape.dir=Dir(!tape.dir);
+        });
+    }
+    for (const Size& size:SIZES) {
+        // Sweep a block back and forth over blank tape.
+        ChainTape tape(0,RIGHT);
+        tape.tape[RIGHT].push_back({1,random_xinteger(size.digits,4)});
+        bench("ChainTape::apply_chain_move "+size.name,[&]() {
+            XInteger num=tape.apply_chain_move(1);
+            keep(num);
+            tape.dir=Dir(!tape.dir);
+        });
+    }
+}
+
+void bench_flight_recorder() {
+    bench("record_flight_event",[]() {record_flight_event(FLIGHT_MACRO,1,10,3);});
+}
+
+// All keys of a macro machine whose base states are running states.
+struct TransKey {
+    int symbol,state;
+    Dir dir;
+};
+
+std::vector<TransKey> block_keys(const BlockMacroMachine& machine) {
+    std::vector<TransKey> keys;
+    for (int symbol=0; symbol<machine.num_symbols; symbol++) {
+        for (int state=0; state<machine.num_states; state++) {
+            for (Dir dir:{LEFT,RIGHT}) keys.push_back({symbol,state,dir});
+        }
+    }
+    return keys;
+}
+
+std::vector<TransKey> backsymbol_keys(const BacksymbolMacroMachine& machine) {
+    std::vector<TransKey> keys;
+    for (int symbol=0; symbol<machine.base_machine->num_symbols; symbol++) {
+        for (int backsymbol=0; backsymbol<machine.base_machine->num_symbols; backsymbol++) {
+            for (int state=0; state<machine.base_machine->num_states; state++) {
+                for (Dir dir:{LEFT,RIGHT}) keys.push_back({symbol,backsymbol*machine.base_num_states+state,dir});
+            }
+        }
+    }
+    return keys;
+}
+
+void bench_trans(const std::string& tm,int block_size) {
+    auto base=std::make_shared<SimpleMachine>(parseTM(tm));
+    auto block=std::make_shared<BlockMacroMachine>(base,block_size);
+    std::vector<TransKey> keys=block_keys(*block);
+    for (const TransKey& key:keys) block->get_trans_object(key.symbol,key.state,key.dir);
+    bench("BlockMacroMachine get_trans_object hit",[&](long long) {},[&](long long i) {
+        const TransKey& key=keys[i%keys.size()];
+        keep(block->get_trans_object(key.symbol,key.state,key.dir));
+    });
+    // Misses go to fresh machines, made before timing.
+    std::vector<std::shared_ptr<BlockMacroMachine>> fresh_blocks;
+    bench("BlockMacroMachine get_trans_object miss",[&](long long n) {
+        fresh_blocks.clear();
+        for (long long i=0; i*(long long)keys.size()<n; i++) fresh_blocks.push_back(std::make_shared<BlockMacroMachine>(base,block_size));
+    },[&](long long i) {
+        const TransKey& key=keys[i%keys.size()];
+        keep(fresh_blocks[i/keys.size()]->get_trans_object(key.symbol,key.state,key.dir));
+    },1<<22);
+    fresh_blocks.clear();
+
+    // The backsymbol machine sits on the warm block machine, so its misses
+    // only pay for its own layer.
+    auto back=std::make_shared<BacksymbolMacroMachine>(block);
+    keys=backsymbol_keys(*back);
+    for (const TransKey& key:keys) back->get_trans_object(key.symbol,key.state,key.dir);
+    bench("BacksymbolMacroMachine get_trans_object hit",[&](long long) {},[&](long long i) {
+        const TransKey& key=keys[i%keys.size()];
+        keep(back->get_trans_object(key.symbol,key.state,key.dir));
+    });
+    std::vector<std::shared_ptr<BacksymbolMacroMachine>> fresh_backs;
+    bench("BacksymbolMacroMachine get_trans_object miss",[&](long long n) {
+        fresh_backs.clear();
+        for (long long i=0; i*(long long)keys.size()<n; i++) fresh_backs.push_back(std::make_shared<BacksymbolMacroMachine>(block));
+    },[&](long long i) {
+        const TransKey& key=keys[i%keys.size()];
+        keep(fresh_backs[i/keys.size()]->get_trans_object(key.symbol,key.state,key.dir));
+    },1<<22);
+}
+
+// Flip the last stripped symbol of a config, which makes a key that
+// compares equal to it for as long as possible.
+StrippedConfig near_miss(StrippedConfig config) {
+    std::vector<StrippedSymbol>& half=std::get<3>(config).empty() ? std::get<2>(config) : std::get<3>(config);
+    half.back().second=!half.back().second;
+    return config;
+}
+
+void bench_prover(const std::string& tm,const std::string& stack,long long num_loops) {
+    std::vector<MacroLayer> layers;
+    parse_macro_stack(stack,layers);
+    std::shared_ptr<TuringMachine> machine=make_macro_stack(parseTM(tm),layers);
+    Simulator sim(machine.get());
+    while (sim.op_state==RUNNING && sim.num_loops<num_loops) sim.step();
+    ProofSystem& prover=sim.prover;
+    if (prover.rules.empty()) {
+        printf("No rules proven in %lld loops\n",num_loops);
+        return;
+    }
+
+    bench("strip_config",[&]() {
+        StrippedConfig config=strip_config(sim.state,sim.tape);
+        keep(config);
+    });
+
+    const StrippedConfig& rule_key=prover.rules.begin()->first;
+    StrippedConfig rule_miss=near_miss(rule_key);
+    bench("rules.find hit",[&]() {keep(prover.rules.find(rule_key));});
+    bench("rules.find miss",[&]() {keep(prover.rules.find(rule_miss));});
+    if (!prover.past_configs.empty()) {
+        const StrippedConfig& past_key=prover.past_configs.begin()->first;
+        StrippedConfig past_miss=near_miss(past_key);
+        bench("past_configs.find hit",[&]() {keep(prover.past_configs.find(past_key));});
+        bench("past_configs.find miss",[&]() {keep(prover.past_configs.find(past_miss));});
+    }
+
+    // The rule with the most blocks that applies finitely many times.
+    const DiffRule* rule=nullptr;
+    int num_var_blocks=0;
+    for (auto& [key,r]:prover.rules) {
+        int num_vars=0;
+        bool finite=0;
+        for (Dir dir:{LEFT,RIGHT}) {
+            for (int i=0; i<r.init_tape.tape[dir].size(); i++) {
+                auto& init_block=r.init_tape.tape[dir][i];
+                if (init_block.num.var.empty()) continue;
+                num_vars++;
+                if (r.fini_tape.tape[dir][i].num.num<init_block.num.num) finite=1;
+            }
+        }
+        if (finite && num_vars>num_var_blocks) {
+            rule=&r;
+            num_var_blocks=num_vars;
+        }
+    }
+    if (!rule) return;
+    for (const Size& size:SIZES) {
+        // A synthetic tape matching the rule, with `size` counts in its variable blocks.
+        ChainTape start(0,rule->init_tape.dir);
+        for (Dir dir:{LEFT,RIGHT}) {
+            start.tape[dir].clear();
+            long long seed=dir*100;
+            for (auto& block:rule->init_tape.tape[dir]) {
+                XInteger num=block.num.num;
+                if (!block.num.var.empty()) num+=random_xinteger(size.digits,seed++);
+                start.tape[dir].push_back({block.symbol,num});
+            }
+        }
+        std::vector<ChainTape> tapes;
+        bench("ProofSystem::apply_diff_rule "+size.name,[&](long long n) {
+            tapes.assign(n,start);
+        },[&](long long i) {
+            keep(prover.apply_diff_rule(*rule,{rule->state,tapes[i],0}));
+        },size.digits>1000 ? 1<<6 : 1<<18);
+    }
+}
+
+// As in quick_sim, before any static initializer. main then counts
+// allocations on top of the pool.
+__attribute__((constructor(101))) void install_pool_first() {
+    install_limb_pool();
+}
+
+int main(int argc,char* argv[]) {
+    mp_get_memory_functions(&gmp_alloc,&gmp_realloc,&gmp_free);
+    mp_set_memory_functions(counting_gmp_alloc,counting_gmp_realloc,counting_gmp_free);
+    if (argc>1) filter=argv[1];
+    bench_xinteger();
+    bench_chain_tape();
+    bench_flight_recorder();
+    // README examples 1 and 3
+    bench_trans("1RB1RA_1RC0RF_0RD---_1LE1LF_1LF1LE_1RA0LD",6);
+    bench_prover("1RB---_1RC1RB_1RD0RA_1LE0RC_0LF0LD_1LB0LF","block4,back",3000);
+    flint_cleanup_master();
+}
@@ -0,0 +1,180 @@
+#include "cycler.h"
+#include <algorithm>
+#include <cassert>
+
+// A saved configuration.
+// [min_pos,max_pos] is the range of cells the head visited since it was saved.
+struct CyclerCheckpoint {
+    bool valid=false;
+    int state=0;
+    long long pos=0,min_pos=0,max_pos=0;
+    FlatTape tape;
+
+    CyclerCheckpoint(uint8_t blank) : tape{blank} {}
+
+    void save(int state,long long pos,const FlatTape& tape) {
+        this->valid=true;
+        this->state=state;
+        this->pos=this->min_pos=this->max_pos=pos;
+        this->tape=tape;
+    }
+};
+
+// Compare len cells of a starting at a_start against b starting at b_start.
+bool segments_equal(const FlatTape& a,long long a_start,const FlatTape& b,long long b_start,long long len) {
+    for (long long i=0; i<len; i++) {
+        if (a.get(a_start+i)!=b.get(b_start+i)) return 0;
+    }
+    return 1;
+}
+
+// A transition packed for the inner loop of detect_cycler.
+struct FlatTransition {
+    uint8_t symbol_out;
+    uint8_t state_out;
+    int8_t move; // -1 or +1
+    uint8_t running;
+};
+
+CyclerResult detect_cycler(const SimpleMachine& machine,long long max_steps,int block_size) {
+    CyclerResult result;
+    assert(machine.num_symbols<=256 && machine.num_states<=256);
+    int num_symbols=machine.num_symbols;
+    std::vector<FlatTransition> ttable(machine.num_states*num_symbols);
+    for (int state=0; state<machine.num_states; state++) {
+        for (int symbol=0; symbol<num_symbols; symbol++) {
+            const Transition& trans=machine.ttable[state][symbol];
+            ttable[state*num_symbols+symbol]={
+                (uint8_t)trans.symbol_out,
+                (uint8_t)(trans.condition==RUNNING ? trans.state_out : 0),
+                (int8_t)(trans.dir_out==RIGHT ? 1 : -1),
+                trans.condition==RUNNING,
+            };
+        }
+    }
+
+    uint8_t blank=machine.init_symbol;
+    FlatTape tape(blank);
+    int state=machine.init_state;
+    int move=(machine.init_dir==RIGHT ? 1 : -1);
+    long long pos=0,min_pos=0,max_pos=0; // [min_pos,max_pos] is every cell ever visited
+
+    // `exact` can be any config. `right` and `left` are only saved when the
+    // head is on a never visited cell, so everything past the head is blank.
+    CyclerCheckpoint exact(blank),right(blank),left(blank);
+    bool save_right=0,save_left=0;
+    long long next_config_save=128;
+
+    // The head enters a block from the left at its first cell and from the right at its last.
+    auto at_block_edge=[block_size](long long pos,int move) {
+        long long offset=((pos%block_size)+block_size)%block_size;
+        return offset==(move>0 ? 0 : block_size-1);
+    };
+
+    // The checkpoints' ranges only change when the head leaves the range
+    // [watch_lo,watch_hi] that all of them cover, which includes every new
+    // record. Only then is the tape grown, so the common step does no checks.
+    long long watch_lo=0,watch_hi=0;
+    uint8_t* cells=tape.cells.data()-tape.lo; // cells[pos] for pos in the tape
+
+    for (long long num_steps=1; num_steps<=max_steps*2; num_steps++) {
+        uint8_t& cell=cells[pos];
+        const FlatTransition& trans=ttable[state*num_symbols+cell];
+        if (!trans.running) {
+            // Base machine stopped running (HALT, UNDEFINED, etc.)
+            const Transition& full_trans=machine.ttable[state][cell];
+            result.op_state=full_trans.condition;
+            result.op_details=full_trans.condition_details;
+            result.num_steps=num_steps;
+            return result;
+        }
+        cell=trans.symbol_out;
+        state=trans.state_out;
+        move=trans.move;
+        pos+=move;
+
+        // Exact cycle: same state and head position, and every cell visited
+        // since the checkpoint is unchanged.
+        if (exact.valid && state==exact.state && pos==exact.pos &&
+                segments_equal(tape,exact.min_pos,exact.tape,exact.min_pos,exact.max_pos-exact.min_pos+1)) {
+            result.op_state=INF_REPEAT;
+            result.inf_reason="INF_CYCLER";
+            result.num_steps=num_steps;
+            return result;
+        }
+
+        if (pos<watch_lo || pos>watch_hi) [[unlikely]] {
+            for (CyclerCheckpoint* c:{&exact,&right,&left}) {
+                c->min_pos=std::min(c->min_pos,pos);
+                c->max_pos=std::max(c->max_pos,pos);
+            }
+            // Translated cycle (Lin recurrence): two records on the same side in the
+            // same state, where the cells between the leftmost (rightmost) cell
+            // visited in between and the head are equal up to the shift.
+            if (pos>max_pos) {
+                max_pos=pos;
+                tape.at(pos);
+                cells=tape.cells.data()-tape.lo;
+                if (right.valid && state==right.state) {
+                    long long shift=pos-right.pos;
+                    if (segments_equal(tape,right.min_pos+shift,right.tape,right.min_pos,right.pos-right.min_pos+1)) {
+                        result.op_state=INF_REPEAT;
+                        result.op_details={(int)shift};
+                        result.inf_reason="INF_TRANSLATED_CYCLER";
+                        result.num_steps=num_steps;
+                        return result;
+                    }
+                }
+                if (save_right) {
+                    right.save(state,pos,tape);
+                    save_right=0;
+                }
+            }
+            else if (pos<min_pos) {
+                min_pos=pos;
+                tape.at(pos);
+                cells=tape.cells.data()-tape.lo;
+                if (left.valid && state==left.state) {
+                    long long shift=pos-left.pos;
+                    if (segments_equal(tape,left.pos+shift,left.tape,left.pos,left.max_pos-left.pos+1)) {
+                        result.op_state=INF_REPEAT;
+                        result.op_details={(int)shift};
+                        result.inf_reason="INF_TRANSLATED_CYCLER";
+                        result.num_steps=num_steps;
+                        return result;
+                    }
+                }
+                if (save_left) {
+                    left.save(state,pos,tape);
+                    save_left=0;
+                }
+            }
+            watch_lo=min_pos;
+            watch_hi=max_pos;
+            for (CyclerCheckpoint* c:{&exact,&right,&left}) {
+                if (!c->valid) continue;
+                watch_lo=std::max(watch_lo,c->min_pos);
+                watch_hi=std::min(watch_hi,c->max_pos);
+            }
+        }
+
+        if (num_steps>=next_config_save) {
+            exact.save(state,pos,tape);
+            save_right=save_left=1;
+            next_config_save*=2;
+            watch_lo=watch_hi=pos;
+        }
+
+        if (num_steps>=max_steps && at_block_edge(pos,move)) {
+            result.num_steps=num_steps;
+            result.at_block_edge=1;
+            result.state=state;
+            result.dir=(move>0 ? RIGHT : LEFT);
+            result.head=pos-tape.lo;
+            result.tape=std::move(tape.cells);
+            return result;
+        }
+    }
+    result.num_steps=max_steps*2;
+    return result;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include "transition.h"
+#include "turing_machine.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A flat tape of base symbols which grows in both directions as needed.
+struct FlatTape {
+    std::vector<uint8_t> cells;
+    long long lo; // position of cells.front()
+    uint8_t blank;
+
+    FlatTape(uint8_t blank) : cells(64,blank), lo{-32}, blank{blank} {}
+
+    uint8_t& at(long long pos) {
+        // The head moves one cell at a time, so growing once is always enough.
+        if (pos<this->lo) {
+            long long grow=this->cells.size();
+            this->cells.insert(this->cells.begin(),grow,this->blank);
+            this->lo-=grow;
+        }
+        else if (pos>=this->lo+(long long)this->cells.size()) {
+            this->cells.resize(this->cells.size()*2,this->blank);
+        }
+        return this->cells[pos-this->lo];
+    }
+
+    int get(long long pos) const {
+        if (pos<this->lo || pos>=this->lo+(long long)this->cells.size()) return this->blank;
+        return this->cells[pos-this->lo];
+    }
+};
+
+// Result of the cycler pre-filter.
+// op_state==RUNNING means the machine survived and needs the macro simulator.
+struct CyclerResult {
+    RunCondition op_state=RUNNING;
+    std::vector<int> op_details;
+    std::string inf_reason;
+    long long num_steps=0;
+
+    // Final configuration when op_state==RUNNING, used to seed the macro
+    // simulator. Only valid if the head just entered a block of block_size
+    // cells (aligned to the starting cell) from direction dir.
+    bool at_block_edge=0;
+    int state=0;
+    Dir dir=RIGHT;
+    long long head=0; // index of the head cell in tape
+    std::vector<uint8_t> tape; // cells outside are blank
+};
+
+// Simulate the base machine directly on a flat tape for up to max_steps steps.
+// Detects HALT, UNDEFINED, exact cycles and translated cycles (Lin recurrence).
+// Uses doubling checkpoints (like sim_limited), so at most 3 tape snapshots are stored.
+// Afterwards it runs on (for up to max_steps more steps) until the head
+// enters a block of block_size cells, so the macro simulator can take over.
+CyclerResult detect_cycler(const SimpleMachine& machine,long long max_steps,int block_size=1);
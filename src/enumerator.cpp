@@ -0,0 +1,152 @@
+#include "enumerator.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <flint/flint.h>
+#include <mutex>
+#include <thread>
+
+// A partially defined machine paused in the middle of its simulation.
+struct EnumNode {
+    SimpleMachine machine;
+    FlatTape tape{0};
+    long long pos=0;
+    int state=0;
+    long long num_steps=0; // steps done so far
+    long long step_limit=0; // simulate up to here
+    int num_defined=0;
+    int max_state=0,max_symbol=0; // highest state and symbol used so far
+};
+
+// Work shared between the enumerator threads.
+struct EnumShared {
+    const EnumOptions& options;
+    const EnumCallback& on_machine;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<EnumNode> nodes;
+    std::atomic<int> num_waiting=0;
+    bool done=0;
+    std::atomic<long long> num_leaves=0;
+
+    EnumShared(const EnumOptions& options,const EnumCallback& on_machine) :
+        options{options}, on_machine{on_machine} {}
+};
+
+// Simulate a node until it needs an undefined transition or reaches its
+// step limit, report its leaves and push its children.
+void expand_node(EnumShared& shared,EnumNode& node,std::vector<EnumNode>& children) {
+    const EnumOptions& options=shared.options;
+    bool replaying=0; // to an undefined transition that on_machine found
+    while (1) {
+        while (node.num_steps<node.step_limit) {
+            uint8_t& cell=node.tape.at(node.pos);
+            const Transition& trans=node.machine.ttable[node.state][cell];
+            if (trans.condition==UNDEFINED) break;
+            cell=trans.symbol_out;
+            node.state=trans.state_out;
+            node.pos+=(trans.dir_out==RIGHT ? 1 : -1);
+            node.num_steps++;
+        }
+        if (node.machine.ttable[node.state][node.tape.get(node.pos)].condition==UNDEFINED) break;
+        CyclerResult prefix;
+        prefix.num_steps=node.num_steps;
+        if (replaying) {
+            prefix.op_state=UNDEFINED;
+            prefix.inf_reason=ENUM_NOT_EXPANDED;
+            shared.num_leaves++;
+            shared.on_machine(node.machine,prefix);
+            return;
+        }
+        long long undefined_step=shared.on_machine(node.machine,prefix);
+        if (undefined_step<0) {
+            shared.num_leaves++;
+            return;
+        }
+        // Resume up to the step before the undefined transition, or give up
+        // right away if it is known to be out of reach.
+        replaying=1;
+        long long replay_limit=node.num_steps+options.max_replay_steps;
+        if (undefined_step==0) node.step_limit=replay_limit;
+        else if (undefined_step-1<=replay_limit) node.step_limit=undefined_step-1;
+    }
+
+    // Halting leaf
+    int symbol=node.tape.get(node.pos);
+    CyclerResult prefix;
+    prefix.op_state=UNDEFINED;
+    prefix.op_details={symbol,node.state};
+    prefix.num_steps=node.num_steps+1;
+    shared.num_leaves++;
+    shared.on_machine(node.machine,prefix);
+
+    // The last undefined transition must stay undefined, to halt.
+    if (node.num_defined+1==options.num_states*options.num_symbols) return;
+    int max_symbol_out=std::min(node.max_symbol+1,options.num_symbols-1);
+    int max_state_out=std::min(node.max_state+1,options.num_states-1);
+    // Pushed in reverse, so the stack pops them in canonical order.
+    for (int symbol_out=max_symbol_out; symbol_out>=0; symbol_out--) {
+        for (Dir dir:{LEFT,RIGHT}) {
+            if (dir==LEFT && node.num_defined==0) continue; // mirror image
+            for (int state_out=max_state_out; state_out>=0; state_out--) {
+                EnumNode& child=children.emplace_back(node);
+                child.machine.ttable[node.state][symbol]={RUNNING,{},symbol_out,state_out,dir,1};
+                child.step_limit=options.max_steps;
+                child.num_defined++;
+                child.max_state=std::max(node.max_state,state_out);
+                child.max_symbol=std::max(node.max_symbol,symbol_out);
+            }
+        }
+    }
+}
+
+// DFS on a local stack, taking work from and giving work to the shared pool.
+void enumerate_worker(EnumShared& shared) {
+    std::vector<EnumNode> local;
+    while (1) {
+        if (local.empty()) {
+            std::unique_lock<std::mutex> lock(shared.mutex);
+            shared.num_waiting++;
+            while (shared.nodes.empty() && !shared.done) {
+                if (shared.num_waiting==shared.options.num_threads) {
+                    // Everyone is out of work.
+                    shared.done=1;
+                    shared.cv.notify_all();
+                }
+                else shared.cv.wait(lock);
+            }
+            if (shared.nodes.empty()) break;
+            shared.num_waiting--;
+            local.push_back(std::move(shared.nodes.back()));
+            shared.nodes.pop_back();
+        }
+        EnumNode node=std::move(local.back());
+        local.pop_back();
+        expand_node(shared,node,local);
+        // Give the biggest subtree (the oldest node) to an idle thread.
+        if (shared.num_waiting>0 && local.size()>1) {
+            std::lock_guard<std::mutex> lock(shared.mutex);
+            shared.nodes.push_back(std::move(local.front()));
+            local.erase(local.begin());
+            shared.cv.notify_one();
+        }
+    }
+}
+
+long long enumerate_tnf(const EnumOptions& options,const EnumCallback& on_machine) {
+    EnumShared shared(options,on_machine);
+    EnumNode root{tmFromQuintuples({},options.num_states,options.num_symbols)};
+    root.step_limit=options.max_steps;
+    shared.nodes.push_back(std::move(root));
+
+    std::vector<std::thread> threads;
+    for (int i=1; i<options.num_threads; i++) {
+        threads.emplace_back([&shared]() {
+            enumerate_worker(shared);
+            flint_cleanup();
+        });
+    }
+    enumerate_worker(shared);
+    for (std::thread& thread:threads) thread.join();
+    return shared.num_leaves;
+}
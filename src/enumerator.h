@@ -0,0 +1,43 @@
+#pragma once
+#include "cycler.h"
+#include "turing_machine.h"
+#include <functional>
+
+struct EnumOptions {
+    int num_states=2;
+    int num_symbols=2;
+    // Steps a machine is simulated for before it is handed to on_machine
+    // without reaching another undefined transition.
+    long long max_steps=1000;
+    // Steps simulated to reach an undefined transition that on_machine found
+    // further on. Leaves that would take more are reported unexpanded.
+    long long max_replay_steps=100000000;
+    int num_threads=1;
+};
+
+// Called for every leaf of the tree, from any worker thread.
+// prefix.op_state is UNDEFINED if the machine halts (stops on an undefined
+// transition) after prefix.num_steps steps, or RUNNING if it ran max_steps
+// steps without needing a new transition.
+// For RUNNING machines, return the step at which the machine reaches an
+// undefined transition if the caller finds one (eg. with run_machine), or 0
+// if it doesn't know the step, so the enumerator simulates the machine up to
+// there and expands it. Otherwise return -1.
+// If that takes more than max_replay_steps, the machine is passed once more
+// with prefix.op_state UNDEFINED and prefix.inf_reason ENUM_NOT_EXPANDED.
+const char* const ENUM_NOT_EXPANDED="NOT_EXPANDED";
+
+using EnumCallback=std::function<long long(const SimpleMachine& machine,const CyclerResult& prefix)>;
+
+// Enumerate the machines of a (states, symbols) class in tree normal form.
+// Each machine starts with every transition undefined and is simulated
+// from the blank tape. When it reaches an undefined transition, that machine
+// is a halting leaf, and one child is made per way to define the transition:
+// - any symbol written so far, or the next new one,
+// - either direction, except RIGHT only for the very first transition,
+// - any state used so far, or the next new one.
+// Children continue from the parent's configuration, so no prefix is ever
+// simulated twice. Machines with every transition defined can't halt and
+// are not made. Subtrees are shared out between num_threads threads.
+// Returns the number of leaves passed to on_machine.
+long long enumerate_tnf(const EnumOptions& options,const EnumCallback& on_machine);
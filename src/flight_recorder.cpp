@@ -0,0 +1,166 @@
+#include "flight_recorder.h"
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+const int MAX_FLIGHT_RECORDERS=256;
+
+// Recorders are never freed, so a signal handler can always read them. A
+// thread's recorder is reused by a later thread once it exits.
+std::atomic<FlightRecorder*> flight_recorders[MAX_FLIGHT_RECORDERS];
+
+__attribute__((tls_model("initial-exec"))) thread_local FlightRecorder* thread_flight_recorder=nullptr;
+
+// Set once the thread gave its recorder back or found none, so the events it
+// records from then on are dropped.
+thread_local bool flight_recorder_gone=0;
+
+// Give the recorder back when the thread exits.
+struct FlightRecorderExit {
+    ~FlightRecorderExit() {
+        if (thread_flight_recorder) thread_flight_recorder->in_use=0;
+        thread_flight_recorder=nullptr;
+        flight_recorder_gone=1;
+    }
+};
+
+FlightRecorder* acquire_flight_recorder() {
+    if (flight_recorder_gone) return nullptr;
+    static thread_local FlightRecorderExit recorder_exit;
+    (void)recorder_exit;
+    FlightRecorder* recorder=nullptr;
+    for (int i=0; i<MAX_FLIGHT_RECORDERS && !recorder; i++) {
+        FlightRecorder* old=flight_recorders[i].load();
+        if (!old) {
+            FlightRecorder* fresh=new FlightRecorder();
+            fresh->in_use=1;
+            if (flight_recorders[i].compare_exchange_strong(old,fresh)) recorder=fresh;
+            else delete fresh;
+        }
+        bool in_use=0;
+        if (old && old->in_use.compare_exchange_strong(in_use,1)) {
+            old->num_events=0;
+            recorder=old;
+        }
+    }
+    if (!recorder) flight_recorder_gone=1;
+    thread_flight_recorder=recorder;
+    return recorder;
+}
+
+// Append-only text buffer, since snprintf isn't async-signal-safe.
+struct DumpBuffer {
+    int fd;
+    char data[4096];
+    int size=0;
+
+    DumpBuffer(int fd) : fd{fd} {}
+
+    void flush() {
+        for (int done=0; done<this->size; ) {
+            ssize_t n=write(this->fd,this->data+done,this->size-done);
+            if (n<=0) break;
+            done+=n;
+        }
+        this->size=0;
+    }
+    void add(const char* s) {
+        for (; *s; s++) {
+            if (this->size==sizeof(this->data)) this->flush();
+            this->data[this->size++]=*s;
+        }
+    }
+    void add(uint64_t x) {
+        char digits[24];
+        int i=sizeof(digits)-1;
+        digits[i]=0;
+        do {
+            digits[--i]='0'+x%10;
+            x/=10;
+        } while (x);
+        this->add(digits+i);
+    }
+    void add_int(int64_t x) {
+        if (x<0) {
+            this->add("-");
+            x=-x;
+        }
+        this->add((uint64_t)x);
+    }
+};
+
+const char* const FLIGHT_KIND_NAMES[]={"macro","chain","rule","proof","failed_proof"};
+
+void dump_flight_recorders(int fd) {
+    DumpBuffer out(fd);
+    for (int i=0; i<MAX_FLIGHT_RECORDERS; i++) {
+        FlightRecorder* recorder=flight_recorders[i].load();
+        if (!recorder) break;
+        uint64_t end=recorder->num_events.load(std::memory_order_relaxed);
+        uint64_t begin=(end>FLIGHT_EVENTS ? end-FLIGHT_EVENTS : 0);
+        out.add("flight recorder ");
+        out.add((uint64_t)i);
+        out.add(recorder->in_use ? "" : " (exited)");
+        out.add(": events ");
+        out.add(begin);
+        out.add(" to ");
+        out.add(end);
+        out.add("\ncycles_since_previous_stamp kind state blocks count_bits\n");
+        uint64_t prev_time=0;
+        for (uint64_t n=begin; n<end; n++) {
+            const FlightEvent& event=recorder->events[n&(FLIGHT_EVENTS-1)];
+            if (!event.time) out.add("-");
+            else {
+                out.add(prev_time ? event.time-prev_time : 0);
+                prev_time=event.time;
+            }
+            out.add(" ");
+            out.add(event.kind<=FLIGHT_FAILED_PROOF ? FLIGHT_KIND_NAMES[event.kind] : "?");
+            out.add(" ");
+            out.add_int(event.state);
+            out.add(" ");
+            out.add((uint64_t)event.num_blocks);
+            out.add(" ");
+            if (event.count_bits==FLIGHT_BITS_INF) out.add("inf");
+            else out.add((uint64_t)event.count_bits);
+            out.add("\n");
+        }
+    }
+    out.flush();
+}
+
+char flight_dump_path[4096];
+
+void dump_flight_recorders_to_path() {
+    int fd=2;
+    if (flight_dump_path[0]) fd=open(flight_dump_path,O_WRONLY|O_CREAT|O_APPEND,0644);
+    if (fd<0) return;
+    dump_flight_recorders(fd);
+    if (fd!=2) close(fd);
+}
+
+void flight_dump_handler(int sig) {
+    int saved_errno=errno;
+    dump_flight_recorders_to_path();
+    errno=saved_errno;
+}
+
+void flight_fatal_handler(int sig) {
+    dump_flight_recorders_to_path();
+    // The handler was reset to the default, so this kills us as the signal would have.
+    raise(sig);
+}
+
+void install_flight_recorder(const std::string& path) {
+    strncpy(flight_dump_path,path.c_str(),sizeof(flight_dump_path)-1);
+    struct sigaction action={};
+    sigemptyset(&action.sa_mask);
+    action.sa_handler=flight_dump_handler;
+    action.sa_flags=SA_RESTART;
+    sigaction(SIGUSR1,&action,nullptr);
+    action.sa_handler=flight_fatal_handler;
+    action.sa_flags=SA_RESETHAND|SA_NODEFER;
+    for (int sig:{SIGABRT,SIGSEGV,SIGBUS,SIGFPE,SIGILL}) sigaction(sig,&action,nullptr);
+}
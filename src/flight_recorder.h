@@ -0,0 +1,113 @@
+#pragma once
+#include "tape.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// Always-on history of the simulation loop, for runs that slow down or die
+// after hours: each thread records its last FLIGHT_EVENTS events (macro,
+// chain and rule moves, proof attempts) in a ring buffer, which is dumped on
+// request, on SIGUSR1, or on a fatal signal (see install_flight_recorder).
+// Recording an event costs a few ns. Reading the cycle counter alone can
+// take 20+ ns (e.g. in VMs), so only rules, proofs and every
+// FLIGHT_STAMP_EVERY-th event get a timestamp.
+
+enum FlightKind : uint8_t {
+    FLIGHT_MACRO,
+    FLIGHT_CHAIN,
+    FLIGHT_RULE,
+    FLIGHT_PROOF, // a rule was proven
+    FLIGHT_FAILED_PROOF,
+};
+
+struct FlightEvent {
+    uint64_t time; // read_cycle_counter(), 0 if not stamped
+    int32_t state;
+    uint32_t num_blocks; // on the whole tape
+    // Bit length of the count involved: the block read by a macro move, the
+    // repetitions of a chain move, or the biggest count on the tape after a
+    // rule or proof. See flight_bits.
+    uint32_t count_bits;
+    FlightKind kind;
+};
+
+const int FLIGHT_EVENTS=1<<12; // per thread, a power of 2
+const int FLIGHT_STAMP_EVERY=16; // a power of 2
+
+inline uint64_t read_cycle_counter() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t t;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(t));
+    return t;
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+const uint32_t FLIGHT_BITS_INF=UINT32_MAX;
+
+inline uint32_t flight_bits(const XInteger& num) {
+    if (num.is_inf()) return FLIGHT_BITS_INF;
+    return fmpz_bits(num.num.value().num);
+}
+
+inline size_t flight_blocks(const ChainTape& tape) {
+    return tape.tape[0].size()+tape.tape[1].size();
+}
+
+// Of the biggest finite count on the tape.
+inline uint32_t max_flight_bits(const ChainTape& tape) {
+    uint32_t bits=0;
+    for (Dir dir:{LEFT,RIGHT}) {
+        for (auto& block:tape.tape[dir]) {
+            if (!block.num.is_inf()) bits=std::max(bits,flight_bits(block.num));
+        }
+    }
+    return bits;
+}
+
+struct FlightRecorder {
+    FlightEvent events[FLIGHT_EVENTS];
+    std::atomic<uint64_t> num_events=0; // ever recorded, only written by the owner
+    std::atomic<bool> in_use=0; // owned by a running thread
+
+    void record(FlightKind kind,int state,size_t num_blocks,uint32_t count_bits) {
+        uint64_t n=this->num_events.load(std::memory_order_relaxed);
+        bool stamp=(n&(FLIGHT_STAMP_EVERY-1))==0 || kind>=FLIGHT_RULE;
+        this->events[n&(FLIGHT_EVENTS-1)]={stamp ? read_cycle_counter() : 0,state,(uint32_t)num_blocks,count_bits,kind};
+        this->num_events.store(n+1,std::memory_order_relaxed);
+    }
+};
+
+// This thread's recorder, nullptr until its first event.
+extern __attribute__((tls_model("initial-exec"))) thread_local FlightRecorder* thread_flight_recorder;
+
+// nullptr if the thread has no recorder: it is exiting, or all
+// MAX_FLIGHT_RECORDERS are taken. Its events are then dropped.
+FlightRecorder* acquire_flight_recorder();
+
+inline void record_flight_event(FlightKind kind,int state,size_t num_blocks,uint32_t count_bits) {
+    FlightRecorder* recorder=thread_flight_recorder;
+    if (!recorder) [[unlikely]] {
+        recorder=acquire_flight_recorder();
+        if (!recorder) return;
+    }
+    recorder->record(kind,state,num_blocks,count_bits);
+}
+
+// Write the events of every thread's recorder to fd, oldest first, as text.
+// Async-signal-safe, though events recorded meanwhile may come out garbled.
+void dump_flight_recorders(int fd);
+
+// Dump on SIGUSR1 and keep running, and on SIGABRT (failed asserts), SIGSEGV,
+// SIGBUS, SIGFPE and SIGILL before dying of the signal. SIGINT and SIGTERM
+// are left alone, so stopping a run doesn't print a dump.
+// Dumps are appended to path, or go to stderr if it is empty.
+void install_flight_recorder(const std::string& path);
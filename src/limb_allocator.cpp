@@ -0,0 +1,268 @@
+#include "limb_allocator.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <flint/flint.h>
+#include <gmp.h>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Every block starts with a header holding its capacity, since FLINT's free
+// and realloc hooks don't pass the old size, and the id of the account it is
+// charged to.
+struct BlockHeader {
+    size_t capacity;
+    uint64_t account_id; // 0 outside any scope
+};
+const size_t HEADER_BYTES=16;
+static_assert(sizeof(BlockHeader)<=HEADER_BYTES);
+const int MIN_CLASS_BITS=4; // smallest class is 16 bytes
+const int NUM_CLASSES=17; // biggest is 1MB
+const size_t POOL_BYTES_PER_CLASS=1<<20; // free bytes kept per class and thread
+
+// All of a thread's state, in one constant-initialized thread_local so the
+// hot path is a single TLS access with no guard.
+struct LimbPool {
+    void* free_lists[NUM_CLASSES]={};
+    int num_free[NUM_CLASSES]={};
+    // Allocated minus freed on this thread. Only written by its thread.
+    std::atomic<long long> live_bytes=0;
+    LimbAccountScope* scope=nullptr;
+    uint64_t account_id=0; // of scope
+    bool registered=0; // in pools, with a PoolExit for this thread
+    bool destroyed=0; // the thread is exiting, use malloc
+
+    void release();
+};
+
+bool pool_enabled=0;
+std::mutex pools_mutex;
+std::vector<LimbPool*> pools;
+// Of threads that exited, and of blocks freed under another account than
+// their own (see credit_owner).
+std::atomic<long long> other_live_bytes=0;
+
+// Live accounts by id, so a block freed after its account is gone finds no
+// account instead of a dangling pointer. Never destroyed, since blocks may be
+// freed by static destructors.
+std::mutex accounts_mutex;
+std::unordered_map<uint64_t,LimbAccount*>& live_accounts() {
+    static auto* accounts=new std::unordered_map<uint64_t,LimbAccount*>();
+    return *accounts;
+}
+std::atomic<uint64_t> next_account_id=1;
+
+LimbAccount::LimbAccount() :
+        id{next_account_id++} {
+    std::lock_guard<std::mutex> lock(accounts_mutex);
+    live_accounts()[this->id]=this;
+}
+
+LimbAccount::~LimbAccount() {
+    std::lock_guard<std::mutex> lock(accounts_mutex);
+    live_accounts().erase(this->id);
+}
+
+__attribute__((tls_model("initial-exec"))) thread_local LimbPool limb_pool;
+
+// Releases the pool at thread exit. Blocks freed after that (e.g. by static
+// destructors) go straight back to malloc.
+struct PoolExit {
+    ~PoolExit() {
+        limb_pool.release();
+        std::lock_guard<std::mutex> lock(pools_mutex);
+        std::erase(pools,&limb_pool);
+        other_live_bytes+=limb_pool.live_bytes;
+        limb_pool.live_bytes=0;
+        limb_pool.destroyed=1;
+    }
+};
+
+void register_pool() {
+    static thread_local PoolExit pool_exit;
+    (void)pool_exit;
+    std::lock_guard<std::mutex> lock(pools_mutex);
+    pools.push_back(&limb_pool);
+    limb_pool.registered=1;
+}
+
+void LimbPool::release() {
+    for (int c=0; c<NUM_CLASSES; c++) {
+        while (void* block=this->free_lists[c]) {
+            this->free_lists[c]=*(void**)block;
+            free(block);
+        }
+        this->num_free[c]=0;
+    }
+}
+
+// Smallest class that holds size bytes, NUM_CLASSES if none does.
+int size_class(size_t size) {
+    if (size<=((size_t)1<<MIN_CLASS_BITS)) return 0;
+    int bits=64-__builtin_clzll(size-1);
+    return std::min(bits-MIN_CLASS_BITS,NUM_CLASSES);
+}
+
+void charge(LimbPool& pool,long long bytes) {
+    if (pool.destroyed) other_live_bytes+=bytes;
+    else pool.live_bytes.store(pool.live_bytes.load(std::memory_order_relaxed)+bytes,std::memory_order_relaxed);
+}
+
+// Charge bytes to the block's own account. Blocks of the current scope's
+// account (the common case) go through the thread's count. Others, e.g. a
+// block of a finished run freed outside any scope, or one allocated outside
+// any scope and freed inside one, bypass it so the scope isn't charged.
+void charge_block(LimbPool& pool,const BlockHeader& header,long long bytes) {
+    if (header.account_id==pool.account_id) {
+        charge(pool,bytes);
+        return;
+    }
+    other_live_bytes+=bytes;
+    if (!header.account_id) return;
+    std::lock_guard<std::mutex> lock(accounts_mutex);
+    auto it=live_accounts().find(header.account_id);
+    if (it!=live_accounts().end()) it->second->live_bytes+=bytes;
+}
+
+char* malloc_block(size_t capacity) {
+    char* block=(char*)malloc(capacity+HEADER_BYTES);
+    if (!block) {
+        fprintf(stderr,"Out of memory allocating %zu bytes\n",capacity);
+        abort();
+    }
+    return block;
+}
+
+void* pool_alloc(size_t size) {
+    LimbPool& pool=limb_pool;
+    if (!pool.registered && !pool.destroyed) register_pool();
+    int c=size_class(size);
+    size_t capacity=(c<NUM_CLASSES ? (size_t)1<<(c+MIN_CLASS_BITS) : size);
+    char* block=nullptr;
+    if (c<NUM_CLASSES && pool.free_lists[c]) {
+        block=(char*)pool.free_lists[c];
+        pool.free_lists[c]=*(void**)block;
+        pool.num_free[c]--;
+    }
+    else block=malloc_block(capacity);
+    *(BlockHeader*)block={capacity,pool.account_id};
+    charge(pool,capacity);
+    return block+HEADER_BYTES;
+}
+
+void pool_free(void* p) {
+    if (!p) return;
+    LimbPool& pool=limb_pool;
+    if (!pool.registered && !pool.destroyed) register_pool();
+    char* block=(char*)p-HEADER_BYTES;
+    BlockHeader header=*(BlockHeader*)block;
+    size_t capacity=header.capacity;
+    charge_block(pool,header,-(long long)capacity);
+    int c=size_class(capacity);
+    if (c<NUM_CLASSES && !pool.destroyed) {
+        int max_free=std::max<int>(4,POOL_BYTES_PER_CLASS>>(c+MIN_CLASS_BITS));
+        if (pool.num_free[c]<max_free) {
+            *(void**)block=pool.free_lists[c];
+            pool.free_lists[c]=block;
+            pool.num_free[c]++;
+            return;
+        }
+    }
+    free(block);
+}
+
+void* pool_realloc(void* p,size_t size) {
+    if (!p) return pool_alloc(size);
+    char* block=(char*)p-HEADER_BYTES;
+    size_t capacity=((BlockHeader*)block)->capacity;
+    if (size<=capacity) return p;
+    if (size_class(capacity)==NUM_CLASSES) {
+        // Big blocks stay with malloc, which may grow them in place.
+        block=(char*)realloc(block,size+HEADER_BYTES);
+        if (!block) {
+            fprintf(stderr,"Out of memory allocating %zu bytes\n",size);
+            abort();
+        }
+        ((BlockHeader*)block)->capacity=size;
+        charge_block(limb_pool,*(BlockHeader*)block,size-capacity);
+        return block+HEADER_BYTES;
+    }
+    void* q=pool_alloc(size);
+    memcpy(q,p,capacity);
+    pool_free(p);
+    return q;
+}
+
+void* pool_calloc(size_t num,size_t size) {
+    void* p=pool_alloc(num*size);
+    memset(p,0,num*size);
+    return p;
+}
+
+void* gmp_pool_realloc(void* p,size_t old_size,size_t size) {
+    return pool_realloc(p,size);
+}
+
+void gmp_pool_free(void* p,size_t size) {
+    pool_free(p);
+}
+
+bool install_limb_pool() {
+    if (pool_enabled) return 1;
+    const char* no_pool=getenv("QUICK_SIM_NO_POOL");
+    if (no_pool && *no_pool && strcmp(no_pool,"0")!=0) return 0;
+    mp_set_memory_functions(pool_alloc,gmp_pool_realloc,gmp_pool_free);
+    __flint_set_memory_functions(pool_alloc,pool_calloc,pool_realloc,pool_free);
+    pool_enabled=1;
+    return 1;
+}
+
+LimbAccountScope::LimbAccountScope(LimbAccount* account) :
+    account{account},
+    prev{limb_pool.scope},
+    base{limb_pool.live_bytes} {
+    // What happens from now on is charged to this scope only.
+    if (this->prev) this->prev->flush();
+    limb_pool.scope=this;
+    limb_pool.account_id=(account ? account->id : 0);
+}
+
+LimbAccountScope::~LimbAccountScope() {
+    this->flush();
+    limb_pool.scope=this->prev;
+    limb_pool.account_id=(this->prev && this->prev->account ? this->prev->account->id : 0);
+    if (this->prev) this->prev->base=limb_pool.live_bytes;
+}
+
+void LimbAccountScope::flush() {
+    long long live=limb_pool.live_bytes;
+    if (this->account) this->account->live_bytes+=live-this->base;
+    this->base=live;
+}
+
+long long LimbAccountScope::sample() {
+    long long live=this->account->live_bytes+(limb_pool.live_bytes-this->base);
+    this->account->peak_bytes=std::max(this->account->peak_bytes,live);
+    return live;
+}
+
+LimbAccount* current_limb_account() {
+    return limb_pool.scope ? limb_pool.scope->account : nullptr;
+}
+
+bool limb_pool_enabled() {
+    return pool_enabled;
+}
+
+long long live_limb_bytes() {
+    std::lock_guard<std::mutex> lock(pools_mutex);
+    long long total=other_live_bytes;
+    for (LimbPool* pool:pools) total+=pool->live_bytes.load(std::memory_order_relaxed);
+    return total;
+}
+
+void release_limb_pool() {
+    limb_pool.release();
+}
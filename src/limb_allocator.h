@@ -0,0 +1,61 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// Pooled allocator for big integer limbs, installed through GMP's and FLINT's
+// memory function hooks by install_limb_pool.
+// Blocks are rounded up to power of 2 size classes, and freed blocks go to a
+// free list of the freeing thread, so the temporaries of one step reuse the
+// buffers of the previous one. Bigger blocks go straight to malloc.
+// Each thread counts the bytes it allocated minus the bytes it freed.
+
+// Live limb bytes (rounded up to size classes) of a simulation: the blocks
+// allocated while one of its scopes was active and not freed yet, on
+// whichever thread and under whichever scope they are freed.
+struct LimbAccount {
+    uint64_t id; // in block headers
+    std::atomic<long long> live_bytes=0; // as of the last flush of each scope
+    long long peak_bytes=0; // sampled, see LimbAccountScope::sample
+
+    LimbAccount();
+    ~LimbAccount();
+    LimbAccount(const LimbAccount&)=delete;
+    LimbAccount& operator=(const LimbAccount&)=delete;
+};
+
+// While in scope, allocations on this thread are charged to account, and so
+// are frees of its blocks. Frees of other blocks go straight to their own
+// account. Scopes nest; the innermost one is charged.
+struct LimbAccountScope {
+    LimbAccount* account;
+    LimbAccountScope* prev;
+    long long base; // thread's live bytes as of the last flush
+
+    LimbAccountScope(LimbAccount* account);
+    ~LimbAccountScope();
+    LimbAccountScope(const LimbAccountScope&)=delete;
+    LimbAccountScope& operator=(const LimbAccountScope&)=delete;
+
+    // Add the bytes charged since the last flush to the account.
+    void flush();
+    // The account's live bytes now (including other active scopes up to
+    // their last flush). Also updates its peak.
+    long long sample();
+};
+
+// The account charged on this thread, nullptr outside any scope.
+LimbAccount* current_limb_account();
+
+// Install the pool as GMP's and FLINT's allocator for the whole process.
+// Call it before anything allocates a GMP or FLINT number, or not at all: a
+// number allocated by malloc and freed into the pool crashes. Returns whether
+// the pool is installed, which it isn't with QUICK_SIM_NO_POOL=1 (to keep
+// malloc, e.g. for valgrind).
+bool install_limb_pool();
+bool limb_pool_enabled();
+
+// Live limb bytes over all threads.
+long long live_limb_bytes();
+
+// Free this thread's pooled blocks. They are also freed at thread exit.
+void release_limb_pool();
@@ -0,0 +1,275 @@
+#include "lockstep.h"
+#include <algorithm>
+#include <cassert>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Packed transition: (next table row << 10) | right << 9 | running << 8 | symbol_out.
+// The next table row is the absolute index of (lane, state_out, symbol 0) in
+// `tables`, so a lookup is tables[state+symbol]. Stopping transitions are 0.
+const int32_t LOCKSTEP_SYMBOL=0xff,LOCKSTEP_RUNNING=1<<8,LOCKSTEP_RIGHT=1<<9,LOCKSTEP_STATE_SHIFT=10;
+
+struct LockstepBatch {
+    const std::vector<SimpleMachine>& machines;
+    std::vector<CyclerResult>& results;
+    int32_t max_steps;
+    int window;
+    int num_lanes;
+    int table_size; // entries per lane
+    long long next_machine=0;
+
+    std::vector<int32_t> tables; // num_lanes*table_size
+    std::vector<int32_t> tapes; // num_lanes*window
+    // Per lane
+    std::vector<int32_t> pos; // absolute index in tapes
+    std::vector<int32_t> state; // absolute index of the state's row in tables
+    std::vector<int32_t> steps;
+    std::vector<long long> machine; // -1 if the lane is idle
+
+    LockstepBatch(
+        const std::vector<SimpleMachine>& machines,
+        std::vector<CyclerResult>& results,
+        int32_t max_steps,
+        int window,
+        int num_lanes
+    );
+
+    // Put the next machine in a lane (or mark it idle).
+    void load(int lane);
+
+    // If the lane's machine is done, record its result and load the next one.
+    void retire_if_done(int lane);
+
+    void run_scalar();
+    void run_avx2();
+    void run_avx512();
+};
+
+LockstepBatch::LockstepBatch(
+    const std::vector<SimpleMachine>& machines,
+    std::vector<CyclerResult>& results,
+    int32_t max_steps,
+    int window,
+    int num_lanes
+) :
+        machines{machines},
+        results{results},
+        max_steps{max_steps},
+        window{window},
+        num_lanes{num_lanes},
+        table_size{1},
+        pos(num_lanes),
+        state(num_lanes),
+        steps(num_lanes),
+        machine(num_lanes,-1) {
+    for (const SimpleMachine& m:machines) {
+        assert(m.num_symbols<=256);
+        this->table_size=std::max(this->table_size,m.num_states*m.num_symbols);
+    }
+    assert((long long)num_lanes*this->table_size<(1<<(31-LOCKSTEP_STATE_SHIFT)));
+    assert((long long)num_lanes*window<INT32_MAX);
+    this->tables.resize(num_lanes*this->table_size);
+    this->tapes.resize(num_lanes*window);
+    for (int lane=0; lane<num_lanes; lane++) this->load(lane);
+}
+
+void LockstepBatch::load(int lane) {
+    if (this->next_machine>=(long long)this->machines.size()) {
+        this->machine[lane]=-1;
+        return;
+    }
+    long long index=this->next_machine++;
+    const SimpleMachine& m=this->machines[index];
+    int32_t base=lane*this->table_size;
+    for (int state=0; state<m.num_states; state++) {
+        for (int symbol=0; symbol<m.num_symbols; symbol++) {
+            const Transition& trans=m.ttable[state][symbol];
+            int32_t& packed=this->tables[base+state*m.num_symbols+symbol];
+            if (trans.condition!=RUNNING) packed=0;
+            else {
+                packed=((base+trans.state_out*m.num_symbols)<<LOCKSTEP_STATE_SHIFT)|
+                    (trans.dir_out==RIGHT ? LOCKSTEP_RIGHT : 0)|LOCKSTEP_RUNNING|trans.symbol_out;
+            }
+        }
+    }
+    std::fill_n(this->tapes.begin()+lane*this->window,this->window,m.init_symbol);
+    this->pos[lane]=lane*this->window+this->window/2;
+    this->state[lane]=base+m.init_state*m.num_symbols;
+    this->steps[lane]=0;
+    this->machine[lane]=index;
+}
+
+void LockstepBatch::retire_if_done(int lane) {
+    if (this->machine[lane]<0) return;
+    CyclerResult& result=this->results[this->machine[lane]];
+    int32_t pos=this->pos[lane];
+    if (pos<lane*this->window || pos>=(lane+1)*this->window || this->steps[lane]>=this->max_steps) {
+        // Survivor
+        result.num_steps=this->steps[lane];
+    }
+    else {
+        int symbol=this->tapes[pos];
+        if (this->tables[this->state[lane]+symbol]&LOCKSTEP_RUNNING) return;
+        // Base machine stopped running (HALT, UNDEFINED, etc.)
+        const SimpleMachine& m=this->machines[this->machine[lane]];
+        const Transition& trans=m.ttable[(this->state[lane]-lane*this->table_size)/m.num_symbols][symbol];
+        result.op_state=trans.condition;
+        result.op_details=trans.condition_details;
+        result.num_steps=this->steps[lane]+1;
+    }
+    this->load(lane);
+}
+
+void LockstepBatch::run_scalar() {
+    for (int lane=0; lane<this->num_lanes; lane++) {
+        int32_t lo=lane*this->window,hi=lo+this->window;
+        while (this->machine[lane]>=0) {
+            int32_t pos=this->pos[lane],state=this->state[lane],steps=this->steps[lane];
+            while (1) {
+                int32_t trans=this->tables[state+this->tapes[pos]];
+                if (!(trans&LOCKSTEP_RUNNING)) break;
+                this->tapes[pos]=trans&LOCKSTEP_SYMBOL;
+                state=trans>>LOCKSTEP_STATE_SHIFT;
+                pos+=(trans&LOCKSTEP_RIGHT ? 1 : -1);
+                steps++;
+                if (pos<lo || pos>=hi || steps>=this->max_steps) break;
+            }
+            this->pos[lane]=pos;
+            this->state[lane]=state;
+            this->steps[lane]=steps;
+            this->retire_if_done(lane);
+        }
+    }
+}
+
+#if defined(__x86_64__)
+// All lanes step together until one of them is done. Then the scalar code
+// retires and refills those lanes, and the vector loop starts again.
+// AVX2 has gathers but no scatters, so tape writes go one lane at a time.
+__attribute__((target("avx2")))
+void LockstepBatch::run_avx2() {
+    assert(this->num_lanes==8);
+    const __m256i symbol_mask=_mm256_set1_epi32(LOCKSTEP_SYMBOL);
+    const __m256i running_bit=_mm256_set1_epi32(LOCKSTEP_RUNNING);
+    const __m256i right_bit=_mm256_set1_epi32(LOCKSTEP_RIGHT);
+    const __m256i one=_mm256_set1_epi32(1);
+    const __m256i lo=_mm256_mullo_epi32(_mm256_setr_epi32(0,1,2,3,4,5,6,7),_mm256_set1_epi32(this->window));
+    const __m256i hi=_mm256_add_epi32(lo,_mm256_set1_epi32(this->window));
+    const __m256i max_steps=_mm256_set1_epi32(this->max_steps);
+    alignas(32) int32_t written[8],where[8];
+    while (1) {
+        alignas(32) int32_t active_lanes[8];
+        bool any_active=0;
+        for (int lane=0; lane<8; lane++) {
+            active_lanes[lane]=(this->machine[lane]>=0 ? -1 : 0);
+            any_active|=(this->machine[lane]>=0);
+        }
+        if (!any_active) break;
+        __m256i active=_mm256_load_si256((const __m256i*)active_lanes);
+        __m256i pos=_mm256_loadu_si256((const __m256i*)this->pos.data());
+        __m256i state=_mm256_loadu_si256((const __m256i*)this->state.data());
+        __m256i steps=_mm256_loadu_si256((const __m256i*)this->steps.data());
+        while (1) {
+            __m256i symbol=_mm256_mask_i32gather_epi32(_mm256_setzero_si256(),this->tapes.data(),pos,active,4);
+            __m256i trans=_mm256_mask_i32gather_epi32(_mm256_setzero_si256(),this->tables.data(),_mm256_add_epi32(state,symbol),active,4);
+            __m256i running=_mm256_cmpeq_epi32(_mm256_and_si256(trans,running_bit),running_bit);
+            // Leave every lane untouched if one of them stops.
+            if (!_mm256_testc_si256(running,active)) break;
+            _mm256_store_si256((__m256i*)written,_mm256_and_si256(trans,symbol_mask));
+            _mm256_store_si256((__m256i*)where,pos);
+            for (int lane=0; lane<8; lane++) {
+                if (active_lanes[lane]) this->tapes[where[lane]]=written[lane];
+            }
+            state=_mm256_blendv_epi8(state,_mm256_srli_epi32(trans,LOCKSTEP_STATE_SHIFT),active);
+            // +1 for right, -1 for left, 0 for idle lanes
+            __m256i right=_mm256_cmpeq_epi32(_mm256_and_si256(trans,right_bit),right_bit);
+            __m256i move=_mm256_and_si256(_mm256_or_si256(_mm256_add_epi32(right,right),one),active);
+            pos=_mm256_add_epi32(pos,_mm256_sub_epi32(_mm256_setzero_si256(),move));
+            steps=_mm256_sub_epi32(steps,active);
+            __m256i done=_mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpgt_epi32(lo,pos),_mm256_cmpgt_epi32(_mm256_add_epi32(pos,one),hi)),
+                _mm256_cmpgt_epi32(_mm256_add_epi32(steps,one),max_steps));
+            if (!_mm256_testz_si256(done,active)) break;
+        }
+        _mm256_storeu_si256((__m256i*)this->pos.data(),pos);
+        _mm256_storeu_si256((__m256i*)this->state.data(),state);
+        _mm256_storeu_si256((__m256i*)this->steps.data(),steps);
+        for (int lane=0; lane<8; lane++) this->retire_if_done(lane);
+    }
+}
+
+// Same as run_avx2, with 16 lanes, mask registers and scattered tape writes.
+__attribute__((target("avx512f")))
+void LockstepBatch::run_avx512() {
+    assert(this->num_lanes==16);
+    const __m512i symbol_mask=_mm512_set1_epi32(LOCKSTEP_SYMBOL);
+    const __m512i running_bit=_mm512_set1_epi32(LOCKSTEP_RUNNING);
+    const __m512i right_bit=_mm512_set1_epi32(LOCKSTEP_RIGHT);
+    const __m512i one=_mm512_set1_epi32(1);
+    const __m512i lo=_mm512_mullo_epi32(
+        _mm512_setr_epi32(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15),_mm512_set1_epi32(this->window));
+    const __m512i hi=_mm512_add_epi32(lo,_mm512_set1_epi32(this->window));
+    const __m512i max_steps=_mm512_set1_epi32(this->max_steps);
+    while (1) {
+        __mmask16 active=0;
+        for (int lane=0; lane<16; lane++) {
+            if (this->machine[lane]>=0) active|=(1<<lane);
+        }
+        if (!active) break;
+        __m512i pos=_mm512_loadu_si512(this->pos.data());
+        __m512i state=_mm512_loadu_si512(this->state.data());
+        __m512i steps=_mm512_loadu_si512(this->steps.data());
+        while (1) {
+            __m512i symbol=_mm512_mask_i32gather_epi32(_mm512_setzero_si512(),active,pos,this->tapes.data(),4);
+            __m512i trans=_mm512_mask_i32gather_epi32(_mm512_setzero_si512(),active,_mm512_add_epi32(state,symbol),this->tables.data(),4);
+            // Leave every lane untouched if one of them stops.
+            if (_mm512_mask_test_epi32_mask(active,trans,running_bit)!=active) break;
+            _mm512_mask_i32scatter_epi32(this->tapes.data(),active,pos,_mm512_and_si512(trans,symbol_mask),4);
+            state=_mm512_mask_srli_epi32(state,active,trans,LOCKSTEP_STATE_SHIFT);
+            __mmask16 right=_mm512_mask_test_epi32_mask(active,trans,right_bit);
+            pos=_mm512_mask_add_epi32(pos,right,pos,one);
+            pos=_mm512_mask_sub_epi32(pos,active&~right,pos,one);
+            steps=_mm512_mask_add_epi32(steps,active,steps,one);
+            __mmask16 done=_mm512_mask_cmplt_epi32_mask(active,pos,lo)|
+                _mm512_mask_cmpge_epi32_mask(active,pos,hi)|
+                _mm512_mask_cmpge_epi32_mask(active,steps,max_steps);
+            if (done) break;
+        }
+        _mm512_storeu_si512(this->pos.data(),pos);
+        _mm512_storeu_si512(this->state.data(),state);
+        _mm512_storeu_si512(this->steps.data(),steps);
+        for (int lane=0; lane<16; lane++) this->retire_if_done(lane);
+    }
+}
+#else
+void LockstepBatch::run_avx2() {assert(0);}
+void LockstepBatch::run_avx512() {assert(0);}
+#endif
+
+LockstepKernel lockstep_best_kernel() {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx512f")) return LOCKSTEP_AVX512;
+    if (__builtin_cpu_supports("avx2")) return LOCKSTEP_AVX2;
+#endif
+    return LOCKSTEP_SCALAR;
+}
+
+std::vector<CyclerResult> triage_lockstep(
+    const std::vector<SimpleMachine>& machines,
+    long long max_steps,
+    int window,
+    LockstepKernel kernel
+) {
+    assert(0<=max_steps && max_steps<INT32_MAX);
+    assert(window>=2);
+    if (kernel==LOCKSTEP_AUTO) kernel=lockstep_best_kernel();
+    std::vector<CyclerResult> results(machines.size());
+    if (max_steps==0) return results;
+    int num_lanes=(kernel==LOCKSTEP_AVX512 ? 16 : kernel==LOCKSTEP_AVX2 ? 8 : 1);
+    LockstepBatch batch(machines,results,max_steps,window,num_lanes);
+    if (kernel==LOCKSTEP_AVX512) batch.run_avx512();
+    else if (kernel==LOCKSTEP_AVX2) batch.run_avx2();
+    else batch.run_scalar();
+    return results;
+}
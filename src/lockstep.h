@@ -0,0 +1,29 @@
+#pragma once
+#include "cycler.h"
+#include "turing_machine.h"
+#include <cstdint>
+#include <vector>
+
+enum LockstepKernel {
+    LOCKSTEP_AUTO, // the widest one this CPU supports
+    LOCKSTEP_SCALAR,
+    LOCKSTEP_AVX2, // 8 lanes
+    LOCKSTEP_AVX512, // 16 lanes
+};
+
+// Short-horizon triage of many machines at once, one machine per SIMD lane.
+// Each lane has its own transition table and a tape window of `window`
+// cells with the head starting in the middle. A lane retires when its
+// machine stops (HALT, UNDEFINED), leaves the window, or has run max_steps
+// steps, and is then refilled with the next machine.
+// Results are in the same order as machines. op_state==RUNNING means the
+// machine survived and needs run_machine.
+std::vector<CyclerResult> triage_lockstep(
+    const std::vector<SimpleMachine>& machines,
+    long long max_steps,
+    int window=256,
+    LockstepKernel kernel=LOCKSTEP_AUTO
+);
+
+// The kernel LOCKSTEP_AUTO picks on this CPU.
+LockstepKernel lockstep_best_kernel();
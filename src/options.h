@@ -0,0 +1,24 @@
+#pragma once
+
+// When Simulator::step calls ProofSystem::log_and_apply.
+enum LogPolicy {
+    LOG_ALWAYS, // before every macro or chain step
+    LOG_EVENTS, // when the head faces an infinite tape end, or in a chosen state/dir
+    LOG_AFTER_CHAIN, // right after a chain move
+    LOG_BACKOFF, // like LOG_ALWAYS, but skip more and more loops while proofs keep failing
+};
+
+// Options shared by Simulator and ProofSystem.
+struct SimOptions {
+    // If false, skip all step accounting (Simulator, GeneralSimulator and
+    // the prover). Verdict, tape and non-blank count are still exact.
+    bool compute_steps=true;
+    LogPolicy log_policy=LOG_ALWAYS;
+    // LOG_EVENTS: base state (0=A) and dir to log in. -1 means only log at tape ends.
+    int log_state=-1;
+    int log_dir=-1;
+    // LOG_BACKOFF: start skipping after this many failed proofs in a row.
+    // Each further failure doubles the skip, up to max_backoff_loops.
+    int backoff_failures=4;
+    long long max_backoff_loops=1<<16;
+};
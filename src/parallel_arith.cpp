@@ -0,0 +1,123 @@
+#include "parallel_arith.h"
+#include "limb_allocator.h"
+#include <algorithm>
+#include <condition_variable>
+#include <flint/flint.h>
+#include <mutex>
+#include <thread>
+
+int num_arith_threads=1;
+// Set while running tasks, so nested calls (parallel_mul inside a task) stay
+// on their thread instead of multiplying the thread count.
+thread_local bool in_parallel=0;
+
+void set_arith_threads(int num_threads) {
+    num_arith_threads=std::max(num_threads,1);
+    // FLINT's own multithreaded code paths, for the calling thread.
+    flint_set_num_threads(num_arith_threads);
+}
+
+// Worker threads for run_parallel, started on first use and kept, so each
+// batch of tasks doesn't pay for creating threads.
+struct ArithPool {
+    std::mutex run_mutex; // one batch at a time
+    std::mutex mutex; // guards the rest
+    std::condition_variable work_ready,work_done;
+    std::vector<std::thread> threads;
+    const std::vector<std::function<void()>>* tasks=nullptr;
+    int num_threads=0; // of the current batch, including the caller
+    LimbAccount* account=nullptr; // of the caller
+    long long batch=0;
+    int num_running=0;
+
+    // Thread t runs tasks t, t+num_threads, ... The calling thread is thread 0.
+    void run_share(int t) {
+        in_parallel=1;
+        for (size_t i=t; i<this->tasks->size(); i+=this->num_threads) (*this->tasks)[i]();
+        in_parallel=0;
+    }
+
+    void worker(int t) {
+        long long seen=0;
+        while (1) {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->work_ready.wait(lock,[&]() {return this->batch!=seen;});
+            seen=this->batch;
+            if (t>=this->num_threads) continue;
+            lock.unlock();
+            {
+                LimbAccountScope scope(this->account);
+                this->run_share(t);
+            }
+            lock.lock();
+            if (--this->num_running==0) this->work_done.notify_one();
+        }
+    }
+};
+
+// Never destroyed: at exit the workers are still waiting, and joining them
+// from a static destructor could run their thread exit code (limb pools,
+// flint_cleanup) after the statics it uses are gone.
+ArithPool& arith_pool() {
+    static ArithPool* pool=new ArithPool();
+    return *pool;
+}
+
+void run_parallel(const std::vector<std::function<void()>>& tasks) {
+    int num_threads=std::min<int>(num_arith_threads,tasks.size());
+    ArithPool& pool=arith_pool();
+    std::unique_lock<std::mutex> run_lock(pool.run_mutex,std::defer_lock);
+    // Nested calls, and calls while another thread has the pool, run here.
+    if (num_threads<=1 || in_parallel || !run_lock.try_lock()) {
+        for (auto& task:tasks) task();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        for (int t=pool.threads.size()+1; t<num_threads; t++) {
+            pool.threads.emplace_back([&pool,t]() {pool.worker(t);});
+        }
+        pool.tasks=&tasks;
+        pool.num_threads=num_threads;
+        pool.account=current_limb_account();
+        pool.num_running=num_threads-1;
+        pool.batch++;
+    }
+    pool.work_ready.notify_all();
+    pool.run_share(0);
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    pool.work_done.wait(lock,[&]() {return pool.num_running==0;});
+    pool.tasks=nullptr;
+}
+
+void parallel_mul(fmpz_t out,const fmpz_t a,const fmpz_t b) {
+    // One level of Karatsuba: with |a|=a1*2^m+a0 and |b|=b1*2^m+b0,
+    // |a*b|=z2*2^2m+(z1-z2-z0)*2^m+z0 for z2=a1*b1, z0=a0*b0 and
+    // z1=(a0+a1)*(b0+b1). The three products are independent, and each
+    // costs about half of the full one, so on 3 threads the product takes
+    // about half as long.
+    ulong m=(std::max(fmpz_bits(a),fmpz_bits(b))+1)/2;
+    fmpz_class a0,a1,b0,b1,a_sum,b_sum,z0,z1,z2;
+    fmpz_abs(a1.num,a);
+    fmpz_fdiv_r_2exp(a0.num,a1.num,m);
+    fmpz_fdiv_q_2exp(a1.num,a1.num,m);
+    fmpz_abs(b1.num,b);
+    fmpz_fdiv_r_2exp(b0.num,b1.num,m);
+    fmpz_fdiv_q_2exp(b1.num,b1.num,m);
+    fmpz_add(a_sum.num,a0.num,a1.num);
+    fmpz_add(b_sum.num,b0.num,b1.num);
+    run_parallel({
+        [&]() {fmpz_mul(z1.num,a_sum.num,b_sum.num);},
+        [&]() {fmpz_mul(z0.num,a0.num,b0.num);},
+        [&]() {fmpz_mul(z2.num,a1.num,b1.num);},
+    });
+    int sign=fmpz_sgn(a)*fmpz_sgn(b);
+    fmpz_sub(z1.num,z1.num,z0.num);
+    fmpz_sub(z1.num,z1.num,z2.num);
+    fmpz_mul_2exp(z2.num,z2.num,m);
+    fmpz_add(z2.num,z2.num,z1.num);
+    fmpz_mul_2exp(z2.num,z2.num,m);
+    fmpz_add(z2.num,z2.num,z0.num);
+    if (sign<0) fmpz_neg(z2.num,z2.num);
+    fmpz_swap(out,z2.num);
+}
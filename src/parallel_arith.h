@@ -0,0 +1,12 @@
+#pragma once
+#include "x_integer.h"
+#include <functional>
+#include <vector>
+
+// Multithreading for arithmetic on huge numbers. num_arith_threads,
+// set_arith_threads and parallel_mul are declared in x_integer.h, since
+// fmpz_class uses them.
+
+// Run independent tasks on up to num_arith_threads threads, including the
+// calling one. Only worth it for tasks on huge numbers.
+void run_parallel(const std::vector<std::function<void()>>& tasks);
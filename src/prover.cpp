@@ -1,6 +1,9 @@
 #include "prover.h"
+#include "flight_recorder.h"
+#include "parallel_arith.h"
 #include "simulator.h"
 #include <algorithm>
+#include <cstdlib>
 
 StrippedSymbol stripped_info(const RepeatedSymbol& block) {
     return {block.symbol,block.num.num==mpz1};
@@ -18,6 +21,19 @@ StrippedConfig strip_config(int state,const ChainTape& tape) {
     return {state,tape.dir,s0,s1};
 }
 
+bool matches_stripped(const StrippedConfig& config,int state,const ChainTape& tape) {
+    auto& [config_state,config_dir,s0,s1]=config;
+    if (config_state!=state || config_dir!=tape.dir) return 0;
+    if (s0.size()!=tape.tape[0].size() || s1.size()!=tape.tape[1].size()) return 0;
+    for (int i=0; i<s0.size(); i++) {
+        if (s0[i]!=stripped_info(tape.tape[0][i])) return 0;
+    }
+    for (int i=0; i<s1.size(); i++) {
+        if (s1[i]!=stripped_info(tape.tape[1][i])) return 0;
+    }
+    return 1;
+}
+
 StrippedConfig gen_strip_config(int state,const GeneralChainTape& tape) {
     std::vector<StrippedSymbol> s0,s1;
     std::transform(tape.tape[0].begin(),tape.tape[0].end(),std::back_inserter(s0),gen_stripped_info);
@@ -48,22 +64,65 @@ bool PastConfig::log_config(long long loop_num) {
     return 1;
 }
 
-ProofSystem::ProofSystem(BacksymbolMacroMachine* machine) :
-    machine{machine} {}
+ProofSystem::ProofSystem(TuringMachine* machine,const SimOptions& options) :
+    machine{machine},
+    options{options} {}
+
+bool ProofSystem::should_log(const ChainTape& tape,int state,bool after_chain,long long loop_num) {
+    bool log=1;
+    switch (this->options.log_policy) {
+        case LOG_ALWAYS:
+            break;
+        case LOG_EVENTS: {
+            // The head faces the infinite blank block at one end of the tape.
+            bool at_end=tape.tape[tape.dir].back().num.is_inf();
+            bool filtered=this->options.log_state>=0 || this->options.log_dir>=0;
+            bool matches=(this->options.log_state<0 || this->machine->base_state(state)==this->options.log_state) &&
+                (this->options.log_dir<0 || tape.dir==this->options.log_dir);
+            log=at_end || (filtered && matches);
+            if (!log) this->num_skipped_events++;
+            break;
+        }
+        case LOG_AFTER_CHAIN:
+            log=after_chain;
+            if (!log) this->num_skipped_chain++;
+            break;
+        case LOG_BACKOFF:
+            log=loop_num>=this->backoff_until;
+            if (!log) this->num_skipped_backoff++;
+            break;
+    }
+    if (log) this->num_logged++;
+    return log;
+}
 
 // Log this configuration into the memory and check if it is similar to a
 // past one. Apply rule if possible.
 ProverResult ProofSystem::log_and_apply(
-    const ChainTape& tape, int state, const XInteger& step_num, long long loop_num
+    ChainTape& tape, int state, const XInteger& step_num, long long loop_num
 ) {
+    DiffRule* prev_rule=(this->last_rule_loop==loop_num-1 ? this->last_rule : nullptr);
+    this->last_rule=nullptr;
     if (tape.tape[0].size()+tape.tape[1].size()>50) {
         return ProverResultNothingToDo{}; // todo: prove rules about big tapes
     }
-    StrippedConfig stripped_config=strip_config(state,tape);
     FullConfig full_config{state,tape,loop_num};
 
+    // Right after a rule, try the rule that followed it last time.
+    if (prev_rule && prev_rule->successor) {
+        DiffRule& successor=*prev_rule->successor;
+        if (matches_stripped(*successor.config,state,tape)) {
+            prev_rule->successor_hits++;
+            this->num_successor_hits++;
+            return this->apply_rule(successor,full_config);
+        }
+        prev_rule->successor_misses++;
+        this->num_successor_misses++;
+    }
+    StrippedConfig stripped_config=strip_config(state,tape);
+
     // Try to apply an already proven rule.
-    if (auto result=this->try_apply_a_rule(stripped_config,full_config); result.has_value()) {
+    if (auto result=this->try_apply_a_rule(stripped_config,full_config,prev_rule); result.has_value()) {
         return result.value();
     }
 
@@ -71,12 +130,41 @@ ProverResult ProofSystem::log_and_apply(
     PastConfig& past_config=this->past_configs[stripped_config];
     if (past_config.log_config(loop_num)) {
         // We see enough of a pattern to try and prove a rule.
-        auto rule=this->prove_rule(stripped_config,full_config,loop_num-past_config.last_loop_num);
-        if (!rule.has_value()) this->num_failed_proofs++;
+        long long delta_loop=loop_num-past_config.last_loop_num;
+        // Don't retry a proof that failed recently.
+        auto failed=this->failed_proofs.find({stripped_config,delta_loop});
+        if (failed!=this->failed_proofs.end() && loop_num<failed->second.retry_loop) {
+            this->num_skipped_proofs++;
+            return ProverResultNothingToDo{};
+        }
+        auto rule=this->prove_rule(stripped_config,full_config,delta_loop);
+        record_flight_event(rule.has_value() ? FLIGHT_PROOF : FLIGHT_FAILED_PROOF,state,flight_blocks(tape),max_flight_bits(tape));
+        if (!rule.has_value()) {
+            // The same proof may succeed later with bigger block counts, so
+            // retry after 2, 4, 8, ... times delta_loop loops.
+            if (failed==this->failed_proofs.end()) {
+                if (this->failed_proofs.size()>=MAX_FAILED_PROOFS) this->forget_failed_proofs(loop_num);
+                failed=this->failed_proofs.emplace(std::make_pair(stripped_config,delta_loop),FailedProof{}).first;
+            }
+            FailedProof& failure=failed->second;
+            failure.num_failures++;
+            failure.retry_loop=loop_num+(delta_loop<<std::min(failure.num_failures,16LL));
+            this->num_failed_proofs++;
+            this->num_failed_in_row++;
+            if (this->options.log_policy==LOG_BACKOFF && this->num_failed_in_row>=this->options.backoff_failures) {
+                long long skip=this->options.max_backoff_loops;
+                if (this->num_failed_in_row-this->options.backoff_failures<62) {
+                    skip=std::min(skip,1LL<<(this->num_failed_in_row-this->options.backoff_failures));
+                }
+                this->backoff_until=loop_num+skip;
+            }
+        }
         else {
+            this->num_failed_in_row=0;
+            if (failed!=this->failed_proofs.end()) this->failed_proofs.erase(failed);
             this->add_rule(rule.value(),stripped_config);
             // Try to apply transition
-            if (auto result=this->try_apply_a_rule(stripped_config,full_config); result.has_value()) {
+            if (auto result=this->try_apply_a_rule(stripped_config,full_config,prev_rule); result.has_value()) {
                 return result.value();
             }
         }
@@ -86,20 +174,37 @@ ProverResult ProofSystem::log_and_apply(
 }
 
 std::optional<ProverResult> ProofSystem::try_apply_a_rule(
-    const StrippedConfig& stripped_config,const FullConfig& full_config
+    const StrippedConfig& stripped_config,const FullConfig& full_config,DiffRule* prev_rule
 ) {
     auto it=this->rules.find(stripped_config);
     if (it==this->rules.end()) return std::nullopt;
-    std::optional<ProverResult> res=this->apply_diff_rule(it->second,full_config);
+    if (prev_rule) prev_rule->successor=&it->second;
+    return this->apply_rule(it->second,full_config);
+}
+
+ProverResult ProofSystem::apply_rule(DiffRule& rule,const FullConfig& full_config) {
+    std::optional<ProverResult> res=this->apply_diff_rule(rule,full_config);
     if (!res.has_value()) return ProverResultNothingToDo{};
-    it->second.num_uses++;
-    return res;
+    rule.num_uses++;
+    if (std::get_if<ProverResultApplyRule>(&res.value())) {
+        this->last_rule=&rule;
+        this->last_rule_loop=std::get<2>(full_config);
+    }
+    return res.value();
+}
+
+void ProofSystem::forget_failed_proofs(long long loop_num) {
+    std::erase_if(this->failed_proofs,[loop_num](const auto& entry) {
+        return entry.second.retry_loop<=loop_num;
+    });
+    if (this->failed_proofs.size()>MAX_FAILED_PROOFS/2) this->failed_proofs.clear();
 }
 
 void ProofSystem::add_rule(const DiffRule& diff_rule,const StrippedConfig& stripped_config) {
     // Remember rule.
     assert(!this->rules.count(stripped_config));
-    this->rules.emplace(stripped_config,diff_rule);
+    auto it=this->rules.emplace(stripped_config,diff_rule).first;
+    it->second.config=&it->first;
     // Clear our memory. We cannot use it for future rules because the
     // number of steps will be wrong now that we have proven this rule.
     this->past_configs.clear();
@@ -113,9 +218,11 @@ std::optional<DiffRule> ProofSystem::prove_rule(
     std::map<int,XInteger> min_val; // Notes the minimum value exponents with each unknown take.
     // Create the limited simulator with limited or no prover.
     GeneralChainTape initial_tape(new_tape,min_val);
-    GeneralSimulator gen_sim(this->machine,new_state,initial_tape);
+    GeneralSimulator gen_sim(this->machine,new_state,initial_tape,this->options.compute_steps);
 
     int max_offset_touched[2]={0,0};
+    // Number of blocks on each half of the final tape, if it matches stripped_config.
+    long long final_size[2]={(long long)std::get<2>(stripped_config).size(),(long long)std::get<3>(stripped_config).size()};
     // Run the simulator
     while (gen_sim.num_loops<delta_loop) {
         const GeneralRepeatedSymbol& block=gen_sim.tape.get_top_block();
@@ -138,9 +245,21 @@ std::optional<DiffRule> ProofSystem::prove_rule(
                 std::max(max_offset_touched[!gen_sim.tape.dir],wrote_offset);
         }
         if (gen_sim.op_state!=RUNNING) return std::nullopt;
-        // Update min_val for each expression.
+        // A loop pushes or pops at most one block on each half (unless it
+        // compresses a pattern). If a half can't get back to its final size
+        // in time, the proof can't succeed.
+        long long loops_left=delta_loop-gen_sim.num_loops;
+        for (Dir dir:{LEFT,RIGHT}) {
+            if (gen_sim.patterns) break;
+            if (std::abs((long long)gen_sim.tape.tape[dir].size()-final_size[dir])>loops_left) return std::nullopt;
+        }
+        // Update min_val for each expression. A loop only changes the top
+        // block of each half, except that a turn can push a new block on top
+        // of the one it just decremented. The others were checked already.
         for (Dir dir:{LEFT,RIGHT}) {
-            for (auto& block:gen_sim.tape.tape[dir]) {
+            auto& half_tape=gen_sim.tape.tape[dir];
+            for (int i=half_tape.size()-1; i>=0 && i>=(int)half_tape.size()-2; i--) {
+                auto& block=half_tape[i];
                 if (block.num.var.size()==0) {}
                 else if (block.num.var.size()==1 && block.num.var.begin()->second.num==mpz1) {
                     int x=block.num.var.begin()->first;
@@ -169,7 +288,7 @@ std::optional<DiffRule> ProofSystem::prove_rule(
             }
         }
     }
-    // Fix num_steps.
+    // Fix num_steps. (empty if !options.compute_steps)
     for (auto& p:gen_sim.step_num.var) {
         gen_sim.step_num.num=gen_sim.step_num.num-(min_val[p.first]-1)*p.second;
     }
@@ -200,11 +319,24 @@ std::optional<ProverResult> ProofSystem::apply_diff_rule(
             int x=init_block.num.var.begin()->first;
             if (start_block.num<init_block.num.num) return std::nullopt;
             if (fini_block.num.num<init_block.num.num) {
-                num_reps=std::min(num_reps,(start_block.num-init_block.num.num)/(init_block.num.num-fini_block.num.num)+1);
+                XInteger reps=start_block.num;
+                reps-=init_block.num.num;
+                reps/=init_block.num.num-fini_block.num.num;
+                reps+=1;
+                if (reps<num_reps) num_reps=std::move(reps);
             }
-            init0_value[x]=start_block.num-init_block.num.num;
+            // Values of x for the first two applications, only needed for the step count.
+            if (!this->options.compute_steps) continue;
+            XInteger& init0=init0_value[x];
+            init0=start_block.num;
+            init0-=init_block.num.num;
             // num_reps=1 causes assert fail due to negative numbers. avoid this.
-            if (XInteger{mpz1}<num_reps) init1_value[x]=(init0_value[x]+fini_block.num.num)-init_block.num.num;
+            if (XInteger{mpz1}<num_reps) {
+                XInteger& init1=init1_value[x];
+                init1=init0;
+                init1+=fini_block.num.num;
+                init1-=init_block.num.num;
+            }
         }
     }
     // If none of the diffs are negative, this will repeat forever.
@@ -214,23 +346,53 @@ std::optional<ProverResult> ProofSystem::apply_diff_rule(
     // Determine number of base steps taken by applying rule.
     // Proof_System.py didn't really help. write the code myself.
     // i=num_reps, j=init0_step, k=init1_step
-    // total steps = (k*(i-1) + j*3 - j*i)*i/2, written to avoid negative numbers
-    XInteger diff_steps=rule.num_steps.substitute(init0_value);
-    if (XInteger{mpz1}<num_reps) {
-        XInteger init1_step=rule.num_steps.substitute(init1_value);
-        diff_steps=(init1_step*(num_reps-1)+diff_steps*3-diff_steps*num_reps)*num_reps/2;
+    // total steps = (k*(i-1) + j*3 - j*i)*i/2 = (j*2 + (k-j)*(i-1))*i/2
+    // Evaluated in place, so no full-size temporaries are made, except for
+    // a product big enough for parallel_mul, which add_mul then materializes.
+    XInteger diff_steps{mpz0};
+    // The step count and each block only depend on num_reps and the rule, so
+    // with million-digit counts they are worth computing concurrently.
+    // Otherwise they are computed right away, without building tasks.
+    bool parallel=num_arith_threads>1 && num_reps.num && fmpz_size(num_reps.num.value().num)>=PARALLEL_MUL_LIMBS;
+    std::vector<std::function<void()>> tasks;
+    if (this->options.compute_steps) {
+        auto compute_steps=[&]() {
+            diff_steps=rule.num_steps.substitute(init0_value);
+            if (!(XInteger{mpz1}<num_reps)) return;
+            XInteger init1_step=rule.num_steps.substitute(init1_value);
+            init1_step-=diff_steps; // k-j, may be negative
+            diff_steps*=2;
+            diff_steps-=init1_step;
+            diff_steps.add_mul(init1_step,num_reps);
+            diff_steps*=num_reps;
+            diff_steps/=2;
+        };
+        if (parallel) tasks.push_back(compute_steps);
+        else compute_steps();
     }
     // Alter the tape to account for applying rule.
-    ChainTape return_tape=std::get<1>(start_config);
+    // Only blocks with a variable can change (the others match the stripped config).
+    ChainTape& tape=std::get<1>(start_config);
     for (Dir dir:{LEFT,RIGHT}) {
         for (int i=0; i<rule.init_tape.tape[dir].size(); i++) {
-            auto& return_block=return_tape.tape[dir][i];
-            if (return_block.num.is_inf()) continue;
             auto& init_block=rule.init_tape.tape[dir][i];
             auto& fini_block=rule.fini_tape.tape[dir][i];
-            return_block.num=return_block.num+fini_block.num.num*num_reps-init_block.num.num*num_reps;
+            if (init_block.num.var.empty() || init_block.num.num==fini_block.num.num) continue;
+            auto& block=tape.tape[dir][i];
+            if (block.num.is_inf()) continue;
+            if (parallel) {
+                tasks.push_back([&block,&init_block,&fini_block,&num_reps]() {
+                    block.num.add_mul(fini_block.num.num,num_reps);
+                    block.num.sub_mul(init_block.num.num,num_reps);
+                });
+            }
+            else {
+                block.num.add_mul(fini_block.num.num,num_reps);
+                block.num.sub_mul(init_block.num.num,num_reps);
+            }
         }
     }
+    if (parallel) run_parallel(tasks);
     // Return the pertinent info
-    return ProverResultApplyRule{return_tape,diff_steps};
+    return ProverResultApplyRule{diff_steps};
 }
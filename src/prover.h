@@ -1,4 +1,5 @@
 #pragma once
+#include "options.h"
 #include "tape.h"
 #include "turing_machine.h"
 #include "x_integer.h"
@@ -7,8 +8,7 @@
 
 // Possible values for ProverResult
 struct ProverResultNothingToDo {}; // No rule applies, nothing to do.
-struct ProverResultApplyRule { // Rule applies, but only finitely many times.
-    ChainTape new_tape;
+struct ProverResultApplyRule { // Rule applies, but only finitely many times. Tape was updated in place.
     XInteger num_base_steps;
 };
 struct ProverResultInfRepeat {}; // Rule applies infinitely.
@@ -22,8 +22,15 @@ typedef std::pair<int,bool> StrippedSymbol; // stripped version of RepeatedSymbo
 // state, dir, left tape, right tape
 typedef std::tuple<int,Dir,std::vector<StrippedSymbol>,std::vector<StrippedSymbol>> StrippedConfig;
 
+// Return a generalized configuration removing the non-1 repetition counts from the tape.
+StrippedConfig strip_config(int state,const ChainTape& tape);
+
+// strip_config(state,tape)==config, without building the stripped config.
+bool matches_stripped(const StrippedConfig& config,int state,const ChainTape& tape);
+
 // state, tape, loop_num
-typedef std::tuple<int,const ChainTape&,long long> FullConfig;
+// The tape is the simulator's own tape. Applying a rule modifies it in place.
+typedef std::tuple<int,ChainTape&,long long> FullConfig;
 
 // A record of info from past instances of a stripped_config.
 // note: this is not really a config
@@ -34,32 +41,74 @@ struct PastConfig {
     bool log_config(long long loop_num);
 };
 
+// A proof attempt that failed, keyed by (stripped config, delta loops).
+struct FailedProof {
+    long long num_failures=0;
+    long long retry_loop=0; // don't try again before this loop
+};
+
+// Most entries ProofSystem.failed_proofs holds. Each key is a whole
+// stripped config, so a long run that keeps failing would grow it forever.
+const size_t MAX_FAILED_PROOFS=4096;
+
 // todo: could implement LimitedDiffRule
 struct DiffRule {
     GeneralChainTape init_tape,fini_tape;
     int state; // both start and stop state. may be redundant due to ProofSystem.rules
-    VarPlusXInteger num_steps;
+    VarPlusXInteger num_steps; // always 0 if !options.compute_steps
     long long num_loops;
     long long num_uses=0; // Number of times this rule has been applied.
+
+    const StrippedConfig* config=nullptr; // its key in ProofSystem.rules
+    // The rule whose config came right after the last application of this
+    // one. Tried first the next time, without stripping the tape.
+    DiffRule* successor=nullptr;
+    long long successor_hits=0,successor_misses=0;
 };
 
 // Stores past information, looks for patterns and tries to prove general
 // rules when it finds patterns.
 struct ProofSystem {
-    // only options.compute_steps is true
-    BacksymbolMacroMachine* machine; // todo: support other machines
+    // supports options.compute_steps true and false
+    TuringMachine* machine;
     std::map<StrippedConfig,PastConfig> past_configs;
     std::map<StrippedConfig,DiffRule> rules;
+    // Unlike past_configs, this is kept when a rule is added. Pruned when it
+    // reaches MAX_FAILED_PROOFS, see forget_failed_proofs.
+    std::map<std::pair<StrippedConfig,long long>,FailedProof> failed_proofs;
     // a lot of other num_* variables that i don't need
-    long long num_failed_proofs=0;
+    long long num_failed_proofs=0,num_skipped_proofs=0;
+    // The rule applied at loop last_rule_loop, for DiffRule.successor.
+    // Rules point into `rules`, so a ProofSystem must not be copied.
+    DiffRule* last_rule=nullptr;
+    long long last_rule_loop=-1;
+    long long num_successor_hits=0,num_successor_misses=0;
+
+    SimOptions options;
+    // Logging policy counters: loops logged, and loops skipped by each policy.
+    long long num_logged=0,num_skipped_events=0,num_skipped_chain=0,num_skipped_backoff=0;
+    // LOG_BACKOFF state
+    long long num_failed_in_row=0,backoff_until=0;
+
+    ProofSystem(TuringMachine* machine,const SimOptions& options={});
 
-    ProofSystem(BacksymbolMacroMachine* machine); // todo: support other machines
+    // Decide whether this loop should call log_and_apply, according to options.log_policy.
+    bool should_log(const ChainTape& tape,int state,bool after_chain,long long loop_num);
 
     ProverResult log_and_apply(
-        const ChainTape& tape,int state,const XInteger& step_num,long long loop_num);
+        ChainTape& tape,int state,const XInteger& step_num,long long loop_num);
 
+    // Look up the rule for stripped_config and apply it. If prev_rule is
+    // given, the rule found becomes its successor.
     std::optional<ProverResult> try_apply_a_rule(
-        const StrippedConfig& stripped_config,const FullConfig& full_config);
+        const StrippedConfig& stripped_config,const FullConfig& full_config,DiffRule* prev_rule=nullptr);
+
+    // Apply a rule whose config matches, NothingToDo if its counts are too small.
+    ProverResult apply_rule(DiffRule& rule,const FullConfig& full_config);
+
+    // Drop the failures whose retry loop has come, which only lose their
+    // backoff, or all of them if that leaves more than half of the maximum.
+    void forget_failed_proofs(long long loop_num);
 
     // Add a proven rule
     void add_rule(const DiffRule& diff_rule,const StrippedConfig& stripped_config);
@@ -69,5 +118,7 @@ struct ProofSystem {
     std::optional<DiffRule> prove_rule(
         const StrippedConfig& stripped_config,const FullConfig& full_config,long long delta_loop);
 
+    // Check whether the rule applies without touching the tape. If it does,
+    // update only the block counts that the rule changes.
     std::optional<ProverResult> apply_diff_rule(const DiffRule& rule,const FullConfig& start_config);
 };
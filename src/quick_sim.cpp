@@ -1,41 +1,502 @@
 // ./quick_sim 1RB0LE_1RC1RB_1RD0RA_0RE---_1LF1LA_1LA1LF 12
 // expected speed: 32500000 loop/s
 
+#include "enumerator.h"
+#include "flight_recorder.h"
+#include "lockstep.h"
+#include "parallel_arith.h"
+#include "results.h"
+#include "run.h"
+#include "scheduler.h"
+#include "seed_database.h"
 #include "simulator.h"
 #include "turing_machine.h"
+#include "work_queue.h"
 #include <cassert>
+#include <chrono>
+#include <climits>
 #include <cstring>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unistd.h>
 
 void run(
-    SimpleMachine machine,
-    int block_size
+    const std::string& tm,
+    const RunOptions& options
 ) {
-    BlockMacroMachine machine2(machine,block_size);
-    BacksymbolMacroMachine machine3(machine2);
-    Simulator sim(&machine3);
-    sim.print_self();
-    long long next_print=100000;
-    for(long long total_loops=0; sim.op_state==RUNNING; total_loops++) {
-        sim.step();
-        if (sim.num_loops>=next_print) {
-            sim.print_self();
-            next_print=next_print*6/5;
-            //if (sim.num_loops>=1000000000) break; // todo: remove
+    RunOptions run_options=options;
+    run_options.on_progress=[](const Simulator& sim,bool finished) {
+        sim.print_self(finished);
+    };
+    RunResult result=run_tm(tm,run_options);
+    if (result.stop==STOP_INVALID_TM) {
+        std::cout<<"Invalid TM: "<<tm<<"\n";
+        return;
+    }
+    if (result.decided_by_cycler) {
+        std::cout<<"Cycler filter: "<<run_condition_to_string(result.record.op_state);
+        if (!result.record.inf_reason.empty()) std::cout<<" "<<result.record.inf_reason;
+        std::cout<<"\n";
+        std::cout<<"Total steps:  "<<result.record.num_steps<<"\n";
+    }
+    else if (limb_pool_enabled()) {
+        if (result.stop==STOP_MAX_MEMORY) std::cout<<"Stopped at the limb memory limit\n";
+        std::cout<<"Peak limb memory: "<<result.peak_limb_bytes/1024<<" KB\n";
+    }
+    std::cout<<"end of run"<<std::endl;
+}
+
+// The machines of a batch run: a seed database, or a text file with one
+// machine per line. Either way a machine's key is its index.
+struct MachineList {
+    std::unique_ptr<SeedDatabase> db;
+    std::vector<std::string> lines;
+    long long num_machines=0;
+
+    // format is "seed-db" or "machines". False if the file can't be read.
+    bool open(const std::string& format,const std::string& path) {
+        if (format=="seed-db") {
+            this->db=std::make_unique<SeedDatabase>(path);
+            if (!this->db->data) return 0;
+            this->num_machines=this->db->num_machines;
+            return 1;
+        }
+        std::ifstream in(path);
+        if (!in) return 0;
+        std::string line;
+        while (std::getline(in,line)) {
+            if (!line.empty()) this->lines.push_back(line);
         }
+        this->num_machines=this->lines.size();
+        return 1;
     }
 
-    sim.print_self(true);
-    std::cout<<"end of run"<<std::endl;
+    // A machine for load_machine to fill in. The list must not be empty.
+    SimpleMachine blank_machine() const {
+        if (this->db) return this->db->get_machine(0);
+        return SimpleMachine({},0,0);
+    }
+
+    // False if the line isn't a valid machine.
+    bool load_machine(long long index,SimpleMachine& machine) const {
+        if (this->db) {
+            this->db->load_machine(index,machine);
+            return 1;
+        }
+        std::optional<SimpleMachine> parsed=tryParseTM(this->lines[index]);
+        if (!parsed) return 0;
+        machine=std::move(parsed.value());
+        return 1;
+    }
+};
+
+// Run machines [begin,end) of a machine list. Each result goes to `results`
+// if given (machines it already has are skipped), otherwise to stdout.
+// Chunks of machines are first triaged together for lockstep_steps steps,
+// only the survivors get run_machine, or iterative deepening if `schedule`
+// is given.
+void run_batch(
+    const MachineList& list,
+    long long begin,
+    long long end,
+    const RunOptions& options,
+    long long lockstep_steps,
+    const ScheduleOptions* schedule,
+    ResultsWriter* results
+) {
+    if (begin>=end) return;
+    auto output=[results](const ResultRecord& record) {
+        if (results) results->write(record);
+        else std::cout<<record.to_line()<<"\n";
+    };
+    std::optional<DeepeningScheduler> scheduler;
+    if (schedule) scheduler.emplace(options,*schedule,[&output](const RunResult& result) {output(result.record);});
+    const long long CHUNK_SIZE=4096;
+    SimpleMachine blank_machine=list.blank_machine();
+    std::vector<SimpleMachine> machines;
+    std::vector<long long> indices;
+    for (long long chunk=begin; chunk<end; chunk+=CHUNK_SIZE) {
+        machines.resize(CHUNK_SIZE,blank_machine);
+        indices.clear();
+        for (long long i=chunk; i<std::min(end,chunk+CHUNK_SIZE); i++) {
+            if (results && results->has_result(std::to_string(i))) continue;
+            if (!list.load_machine(i,machines[indices.size()])) {
+                // Reported like run_tm reports it, so the rest of the batch still runs.
+                ResultRecord record;
+                record.key=std::to_string(i);
+                record.inf_reason=INVALID_TM;
+                output(record);
+                continue;
+            }
+            indices.push_back(i);
+        }
+        machines.resize(indices.size(),blank_machine);
+
+        auto start=std::chrono::steady_clock::now();
+        std::vector<CyclerResult> triage=triage_lockstep(machines,lockstep_steps);
+        double elapsed=std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+        elapsed/=std::max<size_t>(machines.size(),1); // amortized over the chunk
+        for (size_t k=0; k<machines.size(); k++) {
+            std::string key=std::to_string(indices[k]);
+            if (triage[k].op_state!=RUNNING) output(make_record(key,triage[k],elapsed));
+            else if (scheduler) scheduler->add(machines[k],key);
+            else output(run_machine(machines[k],options,key).record);
+        }
+    }
+    if (scheduler) scheduler->finish();
+    std::cout<<std::flush;
+}
+
+// Worker loop of a work queue: claim leases and run them until every lease
+// is done. Returns the number of leases this worker finished.
+long long run_worker(
+    WorkQueue& queue,
+    const MachineList& list,
+    const RunOptions& options,
+    long long lockstep_steps,
+    const ScheduleOptions* schedule,
+    const std::string& worker_id,
+    ResultsWriter& results
+) {
+    long long num_finished=0;
+    while (1) {
+        std::optional<Lease> lease=queue.claim(worker_id);
+        if (!lease) {
+            // Nothing pending: take over leases of dead workers, or wait for
+            // the live ones in case theirs expire.
+            if (queue.reclaim_expired()>0) continue;
+            if (queue.count("claimed")==0 && queue.count("pending")==0) break;
+            std::this_thread::sleep_for(std::chrono::duration<double>(std::min(queue.lease_timeout/4,5.0)));
+            continue;
+        }
+        {
+            LeaseKeeper keeper(queue,lease.value());
+            run_batch(list,lease->begin,lease->end,options,lockstep_steps,schedule,&results);
+            results.flush(); // results first, so a done lease always has them on disk
+        }
+        if (queue.finish(lease.value())) num_finished++;
+        else std::cerr<<"Lease "<<lease->name<<" expired before it finished"<<std::endl;
+    }
+    return num_finished;
+}
+
+// Enumerate a class of machines in tree normal form and run each leaf.
+// Leaves that reach an undefined transition later on are expanded further
+// instead of being reported, unless the enumerator gives up on getting there.
+void run_enumeration(
+    const EnumOptions& enum_options,
+    const RunOptions& options,
+    ResultsWriter* results
+) {
+    std::mutex output_mutex;
+    auto output=[&](const ResultRecord& record) {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        if (results) results->write(record);
+        else std::cout<<record.to_line()<<"\n";
+    };
+    auto has_result=[&](const std::string& key) {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        return results && results->has_result(key);
+    };
+    // Records of machines handed back to the enumerator to expand, in case it
+    // can't get to their undefined transition.
+    std::map<std::string,ResultRecord> expanding;
+    long long num_not_expanded=0;
+    long long num_leaves=enumerate_tnf(enum_options,[&](const SimpleMachine& machine,const CyclerResult& prefix) -> long long {
+        std::string key=tmToString(machine);
+        if (prefix.op_state!=RUNNING) {
+            std::unique_lock<std::mutex> lock(output_mutex);
+            ResultRecord record=make_record(key,prefix,0);
+            if (auto it=expanding.find(key); it!=expanding.end()) {
+                if (prefix.inf_reason==ENUM_NOT_EXPANDED) {
+                    record=it->second;
+                    record.inf_reason=ENUM_NOT_EXPANDED;
+                    num_not_expanded++;
+                }
+                expanding.erase(it);
+            }
+            lock.unlock();
+            if (!has_result(key)) output(record);
+            return -1;
+        }
+        if (has_result(key)) return -1;
+        ResultRecord record=run_machine(machine,options,key).record;
+        if (record.op_state==UNDEFINED) {
+            const std::string& steps=record.num_steps;
+            long long undefined_step=0; // unknown, e.g. with --no-steps
+            if (steps.starts_with("sz=")) undefined_step=LLONG_MAX;
+            else if (!steps.empty() && steps.find_first_not_of("0123456789")==std::string::npos) {
+                undefined_step=(steps.size()<=18 ? std::stoll(steps) : LLONG_MAX);
+            }
+            std::lock_guard<std::mutex> lock(output_mutex);
+            expanding.emplace(key,record);
+            return undefined_step;
+        }
+        output(record);
+        return -1;
+    });
+    std::cout<<std::flush;
+    std::cerr<<"Enumerated "<<num_leaves<<" machines"<<std::endl;
+    if (num_not_expanded) {
+        std::cerr<<"Warning: "<<num_not_expanded<<" machines reach an undefined transition after more than "
+            <<enum_options.max_replay_steps<<" steps, so their subtrees were not expanded ("<<ENUM_NOT_EXPANDED<<")"<<std::endl;
+    }
+}
+
+const char* USAGE=
+    "Usage: quick_sim tm block_size [options]\n"
+    "       quick_sim (--seed-db=file | --machines=file) block_size [--begin=i] [--end=i] [--worker=k/n] [--results=file] [--lockstep-steps=n] [options]\n"
+    "       quick_sim --coordinate=dir (--seed-db=file | --machines=file) [--lease-size=n]\n"
+    "       quick_sim --work=dir block_size [--worker-id=name] [--lease-timeout=seconds] [--lockstep-steps=n] [options]\n"
+    "       quick_sim --merge=dir\n"
+    "       quick_sim --enumerate=states,symbols block_size [--prefix-steps=n] [--threads=n] [--results=file] [options]\n"
+    "Options:\n"
+    "  --stack=layer,...                         macro machine layers, bottom first: blockK, back or pattern (last only) (default: block<block_size>,back)\n"
+    "  --max-loops=n                             loop limit per machine (default: none, 1000000 for batches)\n"
+    "  --log-policy=always|events|chain|backoff  when the prover logs configs\n"
+    "  --log-state=A --log-dir=L|R               extra events for --log-policy=events\n"
+    "  --backoff-failures=n                      failed proofs in a row before backing off\n"
+    "  --no-steps                                don't count steps (faster halting/non-halting triage)\n"
+    "  --cycler-steps=n                          base steps simulated directly (with the cycler filter) before the macro simulator, 0 to skip (default: 1000000, 10000 for one tm)\n"
+    "  --max-seconds=x                           time limit per machine\n"
+    "  --max-limb-memory=MB                      big integer memory limit per machine\n"
+    "  --arith-threads=n                         threads for arithmetic on huge numbers (default: all cores for one tm, 1 otherwise)\n"
+    "  --flight-log=file                         where the recent simulation events go on SIGUSR1 or a fatal signal (default: stderr)\n"
+    "Batch options:\n"
+    "  --deepen[=n]                              iterative deepening: n loops per machine (default 10000) on the first pass\n"
+    "  --growth=x                                deepening budget multiplier per pass (default 4)\n"
+    "  --max-memory=MB --spill-dir=dir           spill suspended tapes to dir beyond MB (default 1024)";
+
+// Read run options from flags. Returns false on a bad value.
+bool parse_run_options(std::map<std::string,std::string>& flags,RunOptions& run_options) {
+    if (flags.count("max-loops")) run_options.max_loops=std::stoll(flags["max-loops"]);
+    if (flags.count("max-seconds")) run_options.max_seconds=std::stod(flags["max-seconds"]);
+    if (flags.count("max-limb-memory")) run_options.max_limb_bytes=std::stoll(flags["max-limb-memory"])<<20;
+    if (flags.count("cycler-steps")) run_options.cycler_steps=std::stoll(flags["cycler-steps"]);
+    if (flags.count("stack") && !parse_macro_stack(flags["stack"],run_options.stack)) return 0;
+    SimOptions& options=run_options.sim_options;
+    if (flags.count("log-policy")) {
+        std::string policy=flags["log-policy"];
+        if (policy=="always") options.log_policy=LOG_ALWAYS;
+        else if (policy=="events") options.log_policy=LOG_EVENTS;
+        else if (policy=="chain") options.log_policy=LOG_AFTER_CHAIN;
+        else if (policy=="backoff") options.log_policy=LOG_BACKOFF;
+        else return 0;
+    }
+    if (flags.count("log-state")) {
+        std::string state=flags["log-state"];
+        if (state.size()!=1 || !('A'<=state[0] && state[0]<='Z')) return 0;
+        options.log_state=state[0]-'A';
+    }
+    if (flags.count("log-dir")) {
+        std::string dir=flags["log-dir"];
+        if (dir=="L") options.log_dir=LEFT;
+        else if (dir=="R") options.log_dir=RIGHT;
+        else return 0;
+    }
+    if (flags.count("backoff-failures")) options.backoff_failures=std::stoi(flags["backoff-failures"]);
+    if (flags.count("no-steps")) options.compute_steps=0;
+    return 1;
+}
+
+// Iterative deepening options, or nullopt without --deepen.
+std::optional<ScheduleOptions> parse_schedule_options(std::map<std::string,std::string>& flags) {
+    if (!flags.count("deepen")) return std::nullopt;
+    ScheduleOptions schedule;
+    if (!flags["deepen"].empty()) schedule.first_budget=std::stoll(flags["deepen"]);
+    if (flags.count("growth")) schedule.growth=std::stod(flags["growth"]);
+    if (flags.count("max-memory")) schedule.max_memory=std::stoll(flags["max-memory"])<<20;
+    if (flags.count("spill-dir")) schedule.spill_dir=flags["spill-dir"];
+    return schedule;
+}
+
+// Before any static initializer, since globals like mpz1 may already allocate.
+__attribute__((constructor(101))) void install_pool_first() {
+    install_limb_pool();
 }
 
 int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        std::cerr << "Usage: quick_sim tm block_size" << std::endl;
+    // Flags look like --name=value. Everything else is positional.
+    std::vector<std::string> args;
+    std::map<std::string,std::string> flags;
+    for (int i=1; i<argc; i++) {
+        std::string arg(argv[i],strlen(argv[i]));
+        if (arg.starts_with("--")) {
+            size_t eq=arg.find('=');
+            if (eq==std::string::npos) flags[arg.substr(2)]="";
+            else flags[arg.substr(2,eq-2)]=arg.substr(eq+1);
+        }
+        else args.push_back(arg);
+    }
+    RunOptions options;
+    if (!parse_run_options(flags,options)) {
+        std::cerr<<USAGE<<std::endl;
+        return 1;
+    }
+    if (options.max_limb_bytes>=0 && !limb_pool_enabled()) {
+        std::cerr<<"--max-limb-memory is unsupported without the limb pool (QUICK_SIM_NO_POOL is set)"<<std::endl;
+        return 1;
+    }
+    install_flight_recorder(flags["flight-log"]);
+    // Batches already keep the cores busy with one machine per thread or process.
+    if (flags.count("arith-threads")) set_arith_threads(std::stoi(flags["arith-threads"]));
+
+    if (flags.count("coordinate")) {
+        std::string format=(flags.count("seed-db") ? "seed-db" : "machines");
+        if (!args.empty() || !flags.count(format)) {
+            std::cerr<<USAGE<<std::endl;
+            return 1;
+        }
+        MachineList list;
+        if (!list.open(format,flags[format])) {
+            std::cerr<<"Cannot read machines: "<<flags[format]<<std::endl;
+            return 1;
+        }
+        long long lease_size=(flags.count("lease-size") ? std::stoll(flags["lease-size"]) : 1000);
+        WorkQueue queue(flags["coordinate"]);
+        if (lease_size<=0 || !queue.create(format,flags[format],list.num_machines,lease_size)) {
+            std::cerr<<"Cannot create work queue: "<<flags["coordinate"]<<std::endl;
+            return 1;
+        }
+        std::cout<<"Queued "<<list.num_machines<<" machines in "<<queue.count("pending")<<" leases"<<std::endl;
+        return 0;
+    }
+
+    if (flags.count("merge")) {
+        WorkQueue queue(flags["merge"]);
+        long long num_lines=queue.merge();
+        if (num_lines<0) {
+            std::cerr<<"Cannot merge results in: "<<flags["merge"]<<std::endl;
+            return 1;
+        }
+        std::cout<<"Merged "<<num_lines<<" results";
+        if (queue.load_info() && num_lines<queue.num_machines) {
+            std::cout<<" ("<<queue.num_machines-num_lines<<" machines missing)";
+        }
+        std::cout<<std::endl;
+        return 0;
+    }
+
+    if (flags.count("work")) {
+        if (args.size()!=1) {
+            std::cerr<<USAGE<<std::endl;
+            return 1;
+        }
+        WorkQueue queue(flags["work"],flags.count("lease-timeout") ? std::stod(flags["lease-timeout"]) : 60);
+        MachineList list;
+        if (!queue.load_info() || !list.open(queue.input_format,queue.input)) {
+            std::cerr<<"Cannot read work queue: "<<flags["work"]<<std::endl;
+            return 1;
+        }
+        options.block_size=std::stoi(args[0]);
+        if (!flags.count("max-loops")) options.max_loops=1000000;
+        std::string worker_id=flags["worker-id"];
+        if (worker_id.empty()) {
+            char host[256]="";
+            gethostname(host,sizeof(host)-1);
+            worker_id=std::string(host)+"-"+std::to_string(getpid());
+        }
+        ResultsWriter results(queue.results_path(worker_id));
+        if (results.fd<0) {
+            std::cerr<<"Cannot open results file: "<<queue.results_path(worker_id)<<std::endl;
+            return 1;
+        }
+        long long lockstep_steps=(flags.count("lockstep-steps") ? std::stoll(flags["lockstep-steps"]) : 10000);
+        std::optional<ScheduleOptions> schedule=parse_schedule_options(flags);
+        long long num_finished=run_worker(queue,list,options,lockstep_steps,schedule ? &schedule.value() : nullptr,worker_id,results);
+        std::cout<<"Worker "<<worker_id<<" finished "<<num_finished<<" leases"<<std::endl;
+        flint_cleanup_master();
+        return 0;
+    }
+
+    if (flags.count("enumerate")) {
+        EnumOptions enum_options;
+        std::string spec=flags["enumerate"];
+        size_t comma=spec.find(',');
+        if (args.size()!=1 || comma==std::string::npos) {
+            std::cerr<<USAGE<<std::endl;
+            return 1;
+        }
+        enum_options.num_states=std::stoi(spec.substr(0,comma));
+        enum_options.num_symbols=std::stoi(spec.substr(comma+1));
+        if (flags.count("prefix-steps")) enum_options.max_steps=std::stoll(flags["prefix-steps"]);
+        enum_options.num_threads=(flags.count("threads") ? std::stoi(flags["threads"]) : std::max(1u,std::thread::hardware_concurrency()));
+        if (!(1<=enum_options.num_states && enum_options.num_states<=26 && 2<=enum_options.num_symbols && enum_options.num_symbols<=10) || enum_options.num_threads<1) {
+            std::cerr<<USAGE<<std::endl;
+            return 1;
+        }
+        options.block_size=std::stoi(args[0]);
+        if (!flags.count("max-loops")) options.max_loops=1000000;
+        std::optional<ResultsWriter> results;
+        if (flags.count("results")) {
+            results.emplace(flags["results"]);
+            if (results->fd<0) {
+                std::cerr<<"Cannot open results file: "<<flags["results"]<<std::endl;
+                return 1;
+            }
+        }
+        run_enumeration(enum_options,options,results ? &results.value() : nullptr);
+        results.reset();
+        flint_cleanup_master();
+        return 0;
+    }
+
+    if (flags.count("seed-db") || flags.count("machines")) {
+        std::string format=(flags.count("seed-db") ? "seed-db" : "machines");
+        if (args.size()!=1) {
+            std::cerr<<USAGE<<std::endl;
+            return 1;
+        }
+        MachineList list;
+        if (!list.open(format,flags[format])) {
+            std::cerr<<"Cannot read machines: "<<flags[format]<<std::endl;
+            return 1;
+        }
+        options.block_size=std::stoi(args[0]);
+        if (!flags.count("max-loops")) options.max_loops=1000000;
+        long long begin=0,end=list.num_machines;
+        if (flags.count("worker")) {
+            std::string worker=flags["worker"];
+            size_t slash=worker.find('/');
+            if (slash==std::string::npos) {
+                std::cerr<<USAGE<<std::endl;
+                return 1;
+            }
+            int k=std::stoi(worker.substr(0,slash)),n=std::stoi(worker.substr(slash+1));
+            if (list.db) std::tie(begin,end)=list.db->worker_range(k,n);
+            else std::tie(begin,end)=std::make_pair(list.num_machines*k/n,list.num_machines*(k+1)/n);
+        }
+        if (flags.count("begin")) begin=std::max(begin,std::stoll(flags["begin"]));
+        if (flags.count("end")) end=std::min(end,std::stoll(flags["end"]));
+        std::optional<ResultsWriter> results;
+        if (flags.count("results")) {
+            results.emplace(flags["results"]);
+            if (results->fd<0) {
+                std::cerr<<"Cannot open results file: "<<flags["results"]<<std::endl;
+                return 1;
+            }
+        }
+        long long lockstep_steps=(flags.count("lockstep-steps") ? std::stoll(flags["lockstep-steps"]) : 10000);
+        std::optional<ScheduleOptions> schedule=parse_schedule_options(flags);
+        run_batch(list,begin,end,options,lockstep_steps,schedule ? &schedule.value() : nullptr,results ? &results.value() : nullptr);
+        results.reset();
+        flint_cleanup_master();
+        return 0;
+    }
+
+    if (args.size()!=2) {
+        std::cerr<<USAGE<<std::endl;
         return 1;
     }
-    SimpleMachine machine = parseTM(std::string(argv[1],strlen(argv[1])));
-    int block_size=std::stoi(argv[2]);
-    run(std::move(machine),block_size);
+    options.block_size=std::stoi(args[1]);
+    // One machine is usually a long runner, which would only pay for a long tier 1.
+    if (!flags.count("cycler-steps")) options.cycler_steps=10000;
+    if (!flags.count("arith-threads")) set_arith_threads(std::max(1u,std::thread::hardware_concurrency()));
+    run(args[0],options);
     flint_cleanup_master(); // this makes valgrind happy. thanks flint.
 }
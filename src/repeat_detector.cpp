@@ -0,0 +1,73 @@
+#include "repeat_detector.h"
+
+// Compares symbols before counts, so most mismatches exit on the first
+// block without touching the big integers.
+bool same_blocks(const std::vector<RepeatedSymbol>& a,size_t a_start,const std::vector<RepeatedSymbol>& b,size_t b_start,size_t len) {
+    for (size_t i=0; i<len; i++) {
+        const RepeatedSymbol& x=a[a_start+i];
+        const RepeatedSymbol& y=b[b_start+i];
+        if (x.symbol!=y.symbol || x.num.is_inf()!=y.num.is_inf() || !(x.num==y.num)) return 0;
+    }
+    return 1;
+}
+
+const char* RepeatDetector::check(int state,const ChainTape& tape,long long num_loops,long long num_rule_moves) {
+    Dir dir=tape.dir;
+    const std::vector<RepeatedSymbol>& back=tape.tape[!dir];
+    bool at_edge=tape.tape[dir].size()==1; // only the infinite blank block ahead
+
+    if (this->have_exact && state==this->exact_state && dir==this->exact_tape.dir &&
+        tape.tape[0].size()==this->exact_tape.tape[0].size() &&
+        tape.tape[1].size()==this->exact_tape.tape[1].size() &&
+        same_blocks(tape.tape[0],0,this->exact_tape.tape[0],0,tape.tape[0].size()) &&
+        same_blocks(tape.tape[1],0,this->exact_tape.tape[1],0,tape.tape[1].size())) {
+        return "INF_CONFIG_REPEAT";
+    }
+
+    if (this->have_edge) {
+        if (num_rule_moves!=this->last_rule_moves) this->have_edge=0;
+        else {
+            long long size=tape.tape[!this->edge_dir].size();
+            this->low_water=std::min(this->low_water,size);
+        }
+    }
+    if (this->have_edge && this->check_translated && at_edge && state==this->edge_state && dir==this->edge_dir) {
+        // Blocks below the anchor were never touched. The anchor itself was
+        // never the top block, though a single move that reversed direction
+        // may have compared its symbol to the one it wrote. If the infinite
+        // block was the top, it's the anchor and must be again.
+        long long old_size=this->edge_back.size(),new_size=back.size();
+        long long anchor=std::max(this->low_water-2,0LL);
+        long long num_above=old_size-1-anchor; // the touched blocks
+        long long new_anchor=new_size-1-num_above;
+        if (new_size>=old_size && back[new_anchor].symbol==this->edge_back[anchor].symbol &&
+            (this->low_water>=2 || new_anchor==0)) {
+            if (same_blocks(back,new_anchor+1,this->edge_back,anchor+1,num_above)) return "INF_TRANSLATED_REPEAT";
+        }
+    }
+
+    if (num_loops>=this->next_save) {
+        this->next_save=std::max(this->next_save,num_loops)*2;
+        this->have_exact=1;
+        this->exact_state=state;
+        this->exact_tape=tape;
+        this->want_edge=1;
+    }
+    if (this->want_edge && at_edge) {
+        this->want_edge=0;
+        this->have_edge=1;
+        this->edge_state=state;
+        this->edge_dir=dir;
+        this->edge_back=back;
+        this->low_water=back.size();
+        this->last_rule_moves=num_rule_moves;
+    }
+    return nullptr;
+}
+
+void RepeatDetector::reset() {
+    this->have_exact=this->have_edge=0;
+    this->exact_tape=ChainTape(0,RIGHT);
+    std::vector<RepeatedSymbol>().swap(this->edge_back);
+    this->next_save=0;
+}
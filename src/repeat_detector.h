@@ -0,0 +1,43 @@
+#pragma once
+#include "tape.h"
+#include <vector>
+
+// Detects machines whose compressed configuration repeats, like sim_limited
+// does inside a macro symbol: a config is saved after 128, 256, 512, ...
+// loops and every later config is compared to it. Two kinds of repeats:
+// - exact: same state, direction, blocks and counts. The ChainTape doesn't
+//   know the head position, so this includes repeats shifted along the tape.
+// - translated: the head is at the blank end of the tape in the same state as
+//   in the saved config (also at the blank end), no rule was applied since,
+//   and the blocks behind the head that were touched since then reappear on
+//   top of a block with the same symbol as the one below them. Then each
+//   period reads and writes the same blocks, just further from the start.
+//   Off (check_translated) for tapes that compress patterns.
+// Configs are compared block by block, after their state, direction and
+// sizes.
+struct RepeatDetector {
+    bool check_translated=1; // see above
+    long long next_save=128;
+    bool want_edge=0; // save the next config at the blank end
+
+    // Exact repeats
+    bool have_exact=0;
+    int exact_state=0;
+    ChainTape exact_tape{0,RIGHT};
+
+    // Translated repeats
+    bool have_edge=0;
+    int edge_state=0;
+    Dir edge_dir=RIGHT; // the blank end the head faces
+    std::vector<RepeatedSymbol> edge_back; // the half tape behind the head
+    long long low_water=0; // fewest blocks behind the head's end since the save
+    long long last_rule_moves=0;
+
+    // Call before each loop with the current config. Returns the inf_reason
+    // if the machine provably repeats forever, nullptr otherwise.
+    const char* check(int state,const ChainTape& tape,long long num_loops,long long num_rule_moves);
+
+    // Free the saved configs, which are as big as the tape, e.g. while the
+    // machine is suspended. New ones are saved from the next check on.
+    void reset();
+};
@@ -0,0 +1,109 @@
+#include "results.h"
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+long long now_ns() {
+    return std::chrono::time_point_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()).time_since_epoch().count();
+}
+
+std::string ResultRecord::to_line() const {
+    std::string s=this->key;
+    s+="\t"+run_condition_to_string(this->op_state);
+    s+="\t"+(this->inf_reason.empty() ? std::string("-") : this->inf_reason);
+    s+="\t"+(this->num_steps.empty() ? std::string("-") : this->num_steps);
+    s+="\t"+std::to_string(this->num_loops);
+    s+="\t"+std::to_string(this->num_macro_moves);
+    s+="\t"+std::to_string(this->num_chain_moves);
+    s+="\t"+std::to_string(this->num_rule_moves);
+    s+="\t"+std::to_string(this->elapsed_time);
+    s+="\t"+(this->num_nonzero.empty() ? std::string("-") : this->num_nonzero);
+    return s;
+}
+
+ResultRecord make_record(const std::string& key,const Simulator& sim) {
+    ResultRecord record;
+    record.key=key;
+    record.op_state=sim.op_state;
+    record.inf_reason=sim.inf_reason;
+    record.num_steps=(sim.options.compute_steps ? sim.step_num.to_short_string() : "-");
+    record.num_loops=sim.num_loops;
+    record.num_macro_moves=sim.num_macro_moves;
+    record.num_chain_moves=sim.num_chain_moves;
+    record.num_rule_moves=sim.num_rule_moves;
+    record.elapsed_time=sim.elapsed_time();
+    record.num_nonzero=sim.num_nonzero().to_short_string();
+    return record;
+}
+
+ResultRecord make_record(const std::string& key,const CyclerResult& cycler,double elapsed_time) {
+    ResultRecord record;
+    record.key=key;
+    record.op_state=cycler.op_state;
+    record.inf_reason=cycler.inf_reason;
+    record.num_steps=std::to_string(cycler.num_steps);
+    record.elapsed_time=elapsed_time;
+    return record;
+}
+
+ResultsWriter::ResultsWriter(const std::string& path,int flush_every,double flush_seconds) :
+        flush_every{flush_every},
+        flush_seconds{flush_seconds},
+        last_flush_time{now_ns()} {
+    this->fd=open(path.c_str(),O_RDWR|O_CREAT|O_APPEND,0644);
+    if (this->fd<0) return;
+    // Load the keys of every complete line.
+    std::string contents;
+    char buf[1<<16];
+    for (ssize_t n; (n=read(this->fd,buf,sizeof(buf)))>0;) contents.append(buf,n);
+    size_t complete=contents.rfind('\n');
+    complete=(complete==std::string::npos ? 0 : complete+1);
+    for (size_t start=0; start<complete;) {
+        size_t end=contents.find('\n',start);
+        size_t tab=std::min(contents.find('\t',start),end);
+        this->done_keys.insert(contents.substr(start,tab-start));
+        start=end+1;
+    }
+    // Drop a partially written record.
+    if (complete<contents.size() && ftruncate(this->fd,complete)!=0) {
+        close(this->fd);
+        this->fd=-1;
+    }
+}
+
+ResultsWriter::~ResultsWriter() {
+    if (this->fd<0) return;
+    this->flush();
+    close(this->fd);
+}
+
+void ResultsWriter::write(const ResultRecord& record) {
+    this->buffer+=record.to_line();
+    this->buffer+="\n";
+    this->done_keys.insert(record.key);
+    this->num_buffered++;
+    if (this->num_buffered>=this->flush_every || (now_ns()-this->last_flush_time)/1e9>=this->flush_seconds) {
+        this->flush();
+    }
+}
+
+void ResultsWriter::flush() {
+    this->last_flush_time=now_ns();
+    if (this->fd<0 || this->buffer.empty()) return;
+    // O_APPEND: every write goes to the current end of the file.
+    size_t done=0;
+    while (done<this->buffer.size()) {
+        ssize_t n=::write(this->fd,this->buffer.data()+done,this->buffer.size()-done);
+        if (n<=0) {
+            // Keep the rest, maybe a later flush succeeds.
+            this->buffer.erase(0,done);
+            return;
+        }
+        done+=n;
+    }
+    fdatasync(this->fd);
+    this->buffer.clear();
+    this->num_buffered=0;
+}
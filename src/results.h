@@ -0,0 +1,51 @@
+#pragma once
+#include "cycler.h"
+#include "simulator.h"
+#include "transition.h"
+#include <string>
+#include <unordered_set>
+
+// Summary of one finished run. One line in a results stream.
+struct ResultRecord {
+    std::string key; // identifies the machine, eg. seed database index or TM text
+    RunCondition op_state=RUNNING;
+    std::string inf_reason;
+    std::string num_steps; // see XInteger::to_short_string
+    long long num_loops=0,num_macro_moves=0,num_chain_moves=0,num_rule_moves=0;
+    double elapsed_time=0;
+    std::string num_nonzero; // non-blank symbols left on the tape, "-" if unknown
+
+    // Tab separated, no newline.
+    std::string to_line() const;
+};
+
+ResultRecord make_record(const std::string& key,const Simulator& sim);
+ResultRecord make_record(const std::string& key,const CyclerResult& cycler,double elapsed_time);
+
+// Append-only results file.
+// Records are buffered and written in batches. On open, the keys already in
+// the file are loaded so a restarted run can skip them. A partial last line
+// (from a killed run) is cut off.
+struct ResultsWriter {
+    int fd=-1; // -1 if the file could not be opened
+    std::string buffer;
+    int num_buffered=0;
+    int flush_every;
+    double flush_seconds;
+    long long last_flush_time;
+    std::unordered_set<std::string> done_keys;
+
+    ResultsWriter(const std::string& path,int flush_every=1000,double flush_seconds=10);
+    ~ResultsWriter();
+    ResultsWriter(const ResultsWriter&)=delete;
+    ResultsWriter& operator=(const ResultsWriter&)=delete;
+
+    bool has_result(const std::string& key) const {
+        return this->done_keys.count(key);
+    }
+
+    void write(const ResultRecord& record);
+
+    // Write out buffered records and sync them to disk.
+    void flush();
+};
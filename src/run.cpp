@@ -0,0 +1,115 @@
+#include "run.h"
+#include "cycler.h"
+#include <chrono>
+#include <flint/flint.h>
+
+// Run the chain simulator until it stops or a limit in options is hit.
+RunResult run_simulator(Simulator& sim,const RunOptions& options,const std::string& key,LimbAccount& account) {
+    RunResult result;
+    LimbAccountScope scope(&account);
+    if (options.on_progress) options.on_progress(sim,0);
+    long long next_print=100000;
+    // Nothing is counted without the pool, so the limit couldn't be kept.
+    if (options.max_limb_bytes>=0 && !limb_pool_enabled()) result.stop=STOP_UNSUPPORTED;
+    else while (sim.op_state==RUNNING) {
+        if (options.max_loops>=0 && sim.num_loops>=options.max_loops) {
+            result.stop=STOP_MAX_LOOPS;
+            break;
+        }
+        if (options.cancel && options.cancel->load(std::memory_order_relaxed)) {
+            result.stop=STOP_CANCELLED;
+            break;
+        }
+        // Checking the clock every loop would be noticeable.
+        if (options.max_seconds>=0 && sim.num_loops%1024==0 && sim.elapsed_time()>=options.max_seconds) {
+            result.stop=STOP_MAX_SECONDS;
+            break;
+        }
+        if (scope.sample()>options.max_limb_bytes && options.max_limb_bytes>=0) {
+            result.stop=STOP_MAX_MEMORY;
+            break;
+        }
+        sim.step();
+        if (options.on_progress && sim.num_loops>=next_print) {
+            options.on_progress(sim,0);
+            next_print=next_print*6/5;
+        }
+    }
+    if (options.on_progress) options.on_progress(sim,1);
+
+    result.record=make_record(key,sim);
+    result.num_blocks=sim.tape.tape[0].size()+sim.tape.tape[1].size();
+    result.num_rules=sim.prover.rules.size();
+    result.num_failed_proofs=sim.prover.num_failed_proofs;
+    scope.sample();
+    result.peak_limb_bytes=account.peak_bytes;
+    return result;
+}
+
+MachineRun start_machine(const SimpleMachine& machine,const RunOptions& options,const std::string& key) {
+    MachineRun run;
+    run.key=key;
+    std::vector<MacroLayer> layers=options.stack;
+    if (layers.empty()) layers={{0,options.block_size},{1,1}};
+    run.machine=make_macro_stack(machine,layers);
+
+    // Tier 1: cheap direct simulation on a flat tape, which also catches
+    // halting and cycling machines before the macro machines are built.
+    CyclerResult cycler;
+    long long start_time=std::chrono::time_point_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now()).time_since_epoch().count();
+    if (options.cycler_steps>0) {
+        cycler=detect_cycler(machine,options.cycler_steps,run.machine->base_cells());
+        if (cycler.op_state!=RUNNING) {
+            long long end_time=std::chrono::time_point_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now()).time_since_epoch().count();
+            run.result.record=make_record(key,cycler,(end_time-start_time)/1e9);
+            run.result.decided_by_cycler=1;
+            return run;
+        }
+    }
+
+    // Tier 2: macro machines, chain simulator and prover, continuing from
+    // wherever tier 1 stopped.
+    run.limb_account=std::make_unique<LimbAccount>();
+    LimbAccountScope scope(run.limb_account.get());
+    run.sim=std::make_unique<Simulator>(run.machine.get(),options.sim_options);
+    run.sim->start_time=start_time;
+    bool seeded=cycler.at_block_edge && run.sim->seed(cycler.state,cycler.dir,cycler.tape,cycler.head,cycler.num_steps);
+    if (seeded) run.result.num_direct_steps=cycler.num_steps;
+    return run;
+}
+
+RunResult& continue_machine(MachineRun& run,const RunOptions& options) {
+    if (!run.sim) return run.result;
+    long long num_direct_steps=run.result.num_direct_steps;
+    run.result=run_simulator(*run.sim,options,run.key,*run.limb_account);
+    run.result.num_direct_steps=num_direct_steps;
+    return run.result;
+}
+
+RunResult run_machine(const SimpleMachine& machine,const RunOptions& options,const std::string& key) {
+    MachineRun run=start_machine(machine,options,key);
+    return continue_machine(run,options);
+}
+
+RunResult run_macro_machine(TuringMachine& machine,const RunOptions& options,const std::string& key) {
+    LimbAccount account;
+    Simulator sim(&machine,options.sim_options);
+    return run_simulator(sim,options,key,account);
+}
+
+RunResult run_tm(const std::string& tm,const RunOptions& options) {
+    std::optional<SimpleMachine> machine=tryParseTM(tm);
+    if (!machine) {
+        RunResult result;
+        result.record.key=tm;
+        result.record.inf_reason=INVALID_TM;
+        result.stop=STOP_INVALID_TM;
+        return result;
+    }
+    return run_machine(machine.value(),options,tm);
+}
+
+void release_thread_memory() {
+    flint_cleanup();
+    release_limb_pool();
+}
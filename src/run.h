@@ -0,0 +1,94 @@
+#pragma once
+#include "limb_allocator.h"
+#include "options.h"
+#include "results.h"
+#include "simulator.h"
+#include "turing_machine.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Why run_machine returned.
+enum RunStop {
+    STOP_DECIDED, // op_state is no longer RUNNING
+    STOP_MAX_LOOPS,
+    STOP_MAX_SECONDS,
+    STOP_CANCELLED,
+    STOP_MAX_MEMORY,
+    STOP_INVALID_TM, // run_tm couldn't parse the machine, nothing was run (inf_reason INVALID_TM)
+    STOP_UNSUPPORTED, // max_limb_bytes was set without the limb pool, nothing was simulated
+};
+
+// inf_reason of the record of a machine that couldn't be parsed.
+const char* const INVALID_TM="INVALID_TM";
+
+struct RunOptions {
+    int block_size=1;
+    // Macro machine layers, bottom first. Empty for a block_size block
+    // machine under a backsymbol machine.
+    std::vector<MacroLayer> stack;
+    // Base steps for the direct flat-tape simulator (tier 1, which includes the
+    // cycler filter) before escalating to the macro simulator. 0 to skip it.
+    long long cycler_steps=1000000;
+    long long max_loops=-1; // -1 for no limit
+    double max_seconds=-1; // -1 for no limit
+    // Live limb bytes of the simulation (see LimbAccount), checked every loop.
+    // -1 for no limit. Needs the limb pool, see install_limb_pool; without it
+    // the run stops with STOP_UNSUPPORTED.
+    long long max_limb_bytes=-1;
+    SimOptions sim_options;
+    // The run stops soon after *cancel becomes true. May be set from any thread.
+    const std::atomic<bool>* cancel=nullptr;
+    // Called on the running thread when the macro simulation starts, every
+    // 100000 loops (growing by 20% each time), and once more when it ends.
+    std::function<void(const Simulator& sim,bool finished)> on_progress;
+};
+
+struct RunResult {
+    ResultRecord record; // verdict and counters
+    RunStop stop=STOP_DECIDED;
+    bool decided_by_cycler=0;
+    long long num_direct_steps=0; // base steps simulated by the cycler (tier 1) that the macro simulator continued from
+    // Tape and prover summary (0 if decided by the cycler)
+    long long num_blocks=0;
+    long long num_rules=0,num_failed_proofs=0;
+    long long peak_limb_bytes=0; // 0 if decided by the cycler or without the limb pool
+};
+
+// Simulate one machine: direct simulation with the cycler filter, then the
+// macro machine stack with the chain simulator and prover, seeded with the
+// tier 1 tape if the stack allows it. Reentrant: each call owns all of its state and
+// prints nothing, so many threads can call it at once.
+RunResult run_machine(const SimpleMachine& machine,const RunOptions& options,const std::string& key="");
+// Parses tm first. A malformed tm gives STOP_INVALID_TM instead of a verdict.
+RunResult run_tm(const std::string& tm,const RunOptions& options);
+
+// A run_machine call split in two, so the simulator can be paused between
+// slices of loops (see DeepeningScheduler).
+struct MachineRun {
+    std::string key;
+    std::shared_ptr<TuringMachine> machine; // the macro machine stack
+    std::unique_ptr<Simulator> sim; // nullptr if decided by the cycler
+    std::unique_ptr<LimbAccount> limb_account; // charged while the simulator runs
+    RunResult result; // as of the last slice
+};
+
+// Tier 1, then set up the simulator without running it. If the cycler
+// decides the machine, run.result has the verdict.
+MachineRun start_machine(const SimpleMachine& machine,const RunOptions& options,const std::string& key="");
+
+// Run the simulator until it stops or a limit in options is hit.
+// options.max_loops counts every loop of the run, so calling this again with
+// a higher limit continues where the last call stopped.
+RunResult& continue_machine(MachineRun& run,const RunOptions& options);
+
+// Run only the chain simulator and prover on an existing macro machine.
+// Its transition caches are thread-safe, so portfolio or batch runs of the
+// same TM on many threads can share one machine and one warm table.
+// options.block_size, options.stack and options.cycler_steps are ignored.
+RunResult run_macro_machine(TuringMachine& machine,const RunOptions& options,const std::string& key="");
+
+// Free FLINT's per-thread caches and pooled limbs. Call before a worker thread exits.
+void release_thread_memory();
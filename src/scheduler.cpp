@@ -0,0 +1,198 @@
+#include "scheduler.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The clock of Simulator::start_time.
+long long system_clock_ns() {
+    return std::chrono::time_point_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now()).time_since_epoch().count();
+}
+
+// Rough heap size of a tape.
+long long tape_bytes(const ChainTape& tape) {
+    long long bytes=0;
+    for (auto& half:tape.tape) {
+        bytes+=half.capacity()*sizeof(RepeatedSymbol);
+        for (auto& block:half) {
+            if (block.num.num) bytes+=fmpz_bits(block.num.num.value().num)/8;
+        }
+    }
+    return bytes;
+}
+
+// Spill files hold each tape half as a count followed by its blocks.
+// Numbers are written in hex, prefixed by their length.
+void write_fmpz(FILE* f,const fmpz_class& x) {
+    char* s=fmpz_get_str(nullptr,16,x.num);
+    long long len=strlen(s);
+    fwrite(&len,sizeof(len),1,f);
+    fwrite(s,1,len,f);
+    flint_free(s);
+}
+
+// Bytes from the read position to the end of the file, so corrupt counts
+// fail the read instead of allocating whatever they say.
+long long bytes_left(FILE* f) {
+    struct stat st;
+    if (fstat(fileno(f),&st)!=0) return 0;
+    return st.st_size-ftell(f);
+}
+
+bool read_fmpz(FILE* f,fmpz_class& x) {
+    long long len;
+    if (fread(&len,sizeof(len),1,f)!=1) return 0;
+    if (len<0 || len>bytes_left(f)) return 0;
+    std::string s(len,'\0');
+    if (fread(s.data(),1,len,f)!=(size_t)len) return 0;
+    return fmpz_set_str(x.num,s.c_str(),16)==0;
+}
+
+void write_xinteger(FILE* f,const XInteger& x) {
+    char kind=(x.is_inf() ? 'I' : 'N');
+    fwrite(&kind,1,1,f);
+    if (kind=='N') write_fmpz(f,x.num.value());
+}
+
+bool read_xinteger(FILE* f,XInteger& x) {
+    char kind;
+    if (fread(&kind,1,1,f)!=1) return 0;
+    if (kind=='I') {
+        x=XInteger{};
+        return 1;
+    }
+    fmpz_class num;
+    if (kind!='N' || !read_fmpz(f,num)) return 0;
+    x=XInteger{num};
+    return 1;
+}
+
+bool write_tape(const std::string& path,const ChainTape& tape) {
+    FILE* f=fopen(path.c_str(),"wb");
+    if (!f) return 0;
+    for (auto& half:tape.tape) {
+        long long size=half.size();
+        fwrite(&size,sizeof(size),1,f);
+        for (auto& block:half) {
+            fwrite(&block.symbol,sizeof(block.symbol),1,f);
+            write_xinteger(f,block.num);
+        }
+    }
+    bool ok=!ferror(f);
+    return fclose(f)==0 && ok;
+}
+
+bool read_tape(const std::string& path,ChainTape& tape) {
+    FILE* f=fopen(path.c_str(),"rb");
+    if (!f) return 0;
+    bool ok=1;
+    for (auto& half:tape.tape) {
+        long long size=0;
+        ok=ok && fread(&size,sizeof(size),1,f)==1;
+        // Each block takes at least its symbol and kind.
+        ok=ok && size>=0 && size<=bytes_left(f)/(long long)(sizeof(RepeatedSymbol::symbol)+1);
+        half.resize(ok ? size : 0);
+        for (auto& block:half) {
+            ok=ok && fread(&block.symbol,sizeof(block.symbol),1,f)==1 && read_xinteger(f,block.num);
+        }
+    }
+    fclose(f);
+    return ok;
+}
+
+DeepeningScheduler::DeepeningScheduler(const RunOptions& options,const ScheduleOptions& schedule,std::function<void(const RunResult&)> on_result) :
+    options{options},
+    schedule{schedule},
+    on_result{on_result},
+    budget{schedule.first_budget} {}
+
+void DeepeningScheduler::add(const SimpleMachine& machine,const std::string& key) {
+    Suspended s;
+    s.run=start_machine(machine,this->options,key);
+    if (!s.run.sim) {
+        this->on_result(s.run.result);
+        return;
+    }
+    this->run_slice(std::move(s));
+}
+
+void DeepeningScheduler::run_slice(Suspended&& s) {
+    bool last_pass=(this->options.max_loops>=0 && this->budget>=this->options.max_loops);
+    RunOptions slice_options=this->options;
+    if (!last_pass) slice_options.max_loops=this->budget;
+    const RunResult& result=continue_machine(s.run,slice_options);
+    if (last_pass || result.stop!=STOP_MAX_LOOPS) {
+        this->on_result(result);
+        return;
+    }
+    s.suspend_time=system_clock_ns();
+    // Its saved configs would take as much memory as the tape, and can't be spilled.
+    {
+        LimbAccountScope scope(s.run.limb_account.get());
+        s.run.sim->repeat_detector.reset();
+    }
+    s.tape_bytes=tape_bytes(s.run.sim->tape);
+    this->memory_used+=s.tape_bytes;
+    this->suspended.push_back(std::move(s));
+    if (this->memory_used>this->schedule.max_memory) this->spill();
+}
+
+void DeepeningScheduler::finish() {
+    while (!this->suspended.empty()) {
+        this->budget=std::max<long long>(this->budget+1,this->budget*this->schedule.growth);
+        std::vector<Suspended> pass;
+        std::swap(pass,this->suspended);
+        // Only machines suspended again count, so spill() doesn't write out
+        // the ones that fit just because the rest of the pass hasn't run yet.
+        for (Suspended& s:pass) {
+            if (s.spill_path.empty()) this->memory_used-=s.tape_bytes;
+        }
+        for (Suspended& s:pass) {
+            Simulator& sim=*s.run.sim;
+            if (!s.spill_path.empty()) {
+                LimbAccountScope scope(s.run.limb_account.get());
+                bool ok=read_tape(s.spill_path,sim.tape);
+                unlink(s.spill_path.c_str());
+                s.spill_path.clear();
+                if (!ok) {
+                    // The tape is lost. Report the machine as it was when suspended.
+                    s.run.result.stop=STOP_MAX_MEMORY;
+                    s.run.result.record.inf_reason="SPILL_READ_FAILED";
+                    this->on_result(s.run.result);
+                    continue;
+                }
+            }
+            // Time spent suspended doesn't count towards elapsed_time.
+            sim.start_time+=system_clock_ns()-s.suspend_time;
+            this->run_slice(std::move(s));
+        }
+    }
+}
+
+void DeepeningScheduler::spill() {
+    if (this->schedule.spill_dir.empty()) return;
+    std::vector<Suspended*> in_memory;
+    for (Suspended& s:this->suspended) {
+        if (s.spill_path.empty()) in_memory.push_back(&s);
+    }
+    std::sort(in_memory.begin(),in_memory.end(),[](Suspended* a,Suspended* b) {
+        return a->tape_bytes>b->tape_bytes;
+    });
+    for (Suspended* s:in_memory) {
+        if (this->memory_used<=this->schedule.max_memory) break;
+        std::string path=this->schedule.spill_dir+"/spill-"+std::to_string(getpid())+"-"+std::to_string(this->num_spills)+".tape";
+        ChainTape& tape=s->run.sim->tape;
+        LimbAccountScope scope(s->run.limb_account.get());
+        if (!write_tape(path,tape)) {
+            unlink(path.c_str());
+            return; // keep it in memory
+        }
+        this->num_spills++;
+        for (auto& half:tape.tape) std::vector<RepeatedSymbol>().swap(half);
+        s->spill_path=path;
+        this->memory_used-=s->tape_bytes;
+    }
+}
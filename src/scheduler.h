@@ -0,0 +1,56 @@
+#pragma once
+#include "run.h"
+#include <functional>
+#include <string>
+#include <vector>
+
+struct ScheduleOptions {
+    long long first_budget=10000; // loops per machine on the first pass
+    double growth=4; // each pass gives survivors this many times more loops
+    // Estimated bytes of suspended tapes to keep in memory. Beyond that the
+    // biggest tapes are spilled to spill_dir (if set).
+    long long max_memory=1LL<<30;
+    std::string spill_dir;
+};
+
+// Runs a batch by iterative deepening, so a few hard machines can't hold up
+// the easy majority. Each machine gets first_budget loops when it is added.
+// Survivors stay suspended and each later pass continues them (nothing is
+// simulated twice) with a budget `growth` times bigger, up to
+// RunOptions::max_loops in total.
+// A suspended machine keeps its Simulator: tape, prover rules and counters.
+// Under memory pressure the tape, which is what grows, is written to disk
+// and read back for the next pass. The prover's rules stay in memory.
+struct DeepeningScheduler {
+    // A machine between passes.
+    struct Suspended {
+        MachineRun run;
+        std::string spill_path; // non-empty while the tape is on disk
+        long long tape_bytes=0; // estimate, while in memory
+        long long suspend_time=0;
+    };
+
+    RunOptions options;
+    ScheduleOptions schedule;
+    std::function<void(const RunResult&)> on_result;
+
+    std::vector<Suspended> suspended;
+    long long budget; // total loops per machine by the end of the current pass
+    long long memory_used=0;
+    long long num_spills=0;
+
+    DeepeningScheduler(const RunOptions& options,const ScheduleOptions& schedule,std::function<void(const RunResult&)> on_result);
+
+    // Run the first pass of a machine now. on_result is called if it finishes.
+    void add(const SimpleMachine& machine,const std::string& key);
+
+    // Run the later passes until every machine finished. on_result is called
+    // for each as it finishes, easy ones first.
+    void finish();
+
+    // Run a machine up to `budget` loops, and either report it or keep it.
+    void run_slice(Suspended&& machine);
+
+    // Write tapes to disk, biggest first, until memory_used<=max_memory.
+    void spill();
+};
@@ -0,0 +1,68 @@
+#include "seed_database.h"
+#include <cassert>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+unsigned int read_u32_be(const unsigned char* p) {
+    return (unsigned int)p[0]<<24 | (unsigned int)p[1]<<16 | (unsigned int)p[2]<<8 | (unsigned int)p[3];
+}
+
+SeedDatabase::SeedDatabase(const std::string& path) {
+    this->fd=open(path.c_str(),O_RDONLY);
+    if (this->fd<0) return;
+    struct stat st;
+    if (fstat(this->fd,&st)!=0 || st.st_size<HEADER_SIZE) return;
+    void* p=mmap(nullptr,st.st_size,PROT_READ,MAP_PRIVATE,this->fd,0);
+    if (p==MAP_FAILED) return;
+    madvise(p,st.st_size,MADV_SEQUENTIAL);
+    this->data=(const unsigned char*)p;
+    this->size=st.st_size;
+    this->num_machines=(this->size-HEADER_SIZE)/RECORD_SIZE;
+    this->num_undecided_time=read_u32_be(this->data);
+    this->num_undecided_space=read_u32_be(this->data+4);
+    this->num_undecided_total=read_u32_be(this->data+8);
+}
+
+SeedDatabase::~SeedDatabase() {
+    if (this->data) munmap((void*)this->data,this->size);
+    if (this->fd>=0) close(this->fd);
+}
+
+void SeedDatabase::load_machine(long long index,SimpleMachine& machine) const {
+    assert(0<=index && index<this->num_machines);
+    assert(machine.num_states==NUM_STATES && machine.num_symbols==NUM_SYMBOLS);
+    const unsigned char* record=this->data+HEADER_SIZE+index*RECORD_SIZE;
+    // Each transition is 3 bytes: symbol_out, dir_out (0=R, 1=L), state_out (1-5, 0=undefined).
+    for (int state_in=0; state_in<NUM_STATES; state_in++) {
+        for (int symbol_in=0; symbol_in<NUM_SYMBOLS; symbol_in++,record+=3) {
+            Transition& trans=machine.ttable[state_in][symbol_in];
+            if (record[2]==0) {
+                trans.condition=UNDEFINED;
+                trans.condition_details={symbol_in,state_in};
+                trans.symbol_out=1;
+                trans.state_out=-1;
+                trans.dir_out=RIGHT;
+            }
+            else {
+                trans.condition=RUNNING;
+                trans.condition_details.clear();
+                trans.symbol_out=record[0];
+                trans.state_out=record[2]-1;
+                trans.dir_out=(record[1]==0 ? RIGHT : LEFT);
+            }
+        }
+    }
+}
+
+SimpleMachine SeedDatabase::get_machine(long long index) const {
+    SimpleMachine machine=tmFromQuintuples({},NUM_STATES,NUM_SYMBOLS);
+    this->load_machine(index,machine);
+    return machine;
+}
+
+std::pair<long long,long long> SeedDatabase::worker_range(int worker,int num_workers) const {
+    assert(0<=worker && worker<num_workers);
+    return {this->num_machines*worker/num_workers,this->num_machines*(worker+1)/num_workers};
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include "turing_machine.h"
+#include <string>
+#include <utility>
+
+// Read-only view of a seed database file: a 30-byte header followed by
+// 30-byte records of 5-state, 2-symbol machines.
+// The file is mmapped and records are decoded on demand, nothing is copied up front.
+struct SeedDatabase {
+    static const int HEADER_SIZE=30,RECORD_SIZE=30;
+    static const int NUM_STATES=5,NUM_SYMBOLS=2;
+
+    int fd=-1;
+    const unsigned char* data=nullptr; // nullptr if the file could not be mapped
+    size_t size=0;
+    long long num_machines=0;
+
+    // Header counts (big-endian in the file).
+    unsigned int num_undecided_time=0,num_undecided_space=0,num_undecided_total=0;
+
+    SeedDatabase(const std::string& path);
+    ~SeedDatabase();
+    SeedDatabase(const SeedDatabase&)=delete;
+    SeedDatabase& operator=(const SeedDatabase&)=delete;
+
+    // Decode record `index` into an existing 5-state 2-symbol table in place,
+    // so a worker can reuse one SimpleMachine for its whole range.
+    void load_machine(long long index,SimpleMachine& machine) const;
+
+    SimpleMachine get_machine(long long index) const;
+
+    // Split [0,num_machines) into num_workers contiguous ranges [begin,end).
+    std::pair<long long,long long> worker_range(int worker,int num_workers) const;
+};
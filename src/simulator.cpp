@@ -1,36 +1,84 @@
 #include "simulator.h"
+#include "flight_recorder.h"
 #include <cassert>
 #include <chrono>
 #include <iostream>
 
-Simulator::Simulator(BacksymbolMacroMachine* machine) :
+Simulator::Simulator(TuringMachine* machine,const SimOptions& options) :
     machine{machine},
     state{machine->init_state},
     dir{machine->init_dir},
     tape{ChainTape(machine->init_symbol,machine->init_dir)},
-    prover{machine},
+    patterns{machine->pattern_machine()},
+    prover{machine,options},
+    options{options},
     start_time{std::chrono::time_point_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now()).time_since_epoch().count()} {
-        //
+        // Compressing reads blocks below the ones it changes.
+        this->repeat_detector.check_translated=!this->patterns;
     }
 
+bool Simulator::seed(int base_state,Dir dir,const std::vector<uint8_t>& cells,long long head,long long num_steps) {
+    int width=this->machine->base_cells();
+    int num_symbols=this->machine->base_num_symbols();
+    int num_held=this->machine->num_held_symbols();
+    // Block 0 is the one the head is in, block `ahead` is the next one in direction dir.
+    long long start=(dir==RIGHT ? head : head-width+1);
+    int ahead=(dir==RIGHT ? 1 : -1);
+    auto get_block=[&](long long j) {
+        int symbol=0;
+        for (long long pos=start+j*width+width-1; pos>=start+j*width; pos--) {
+            symbol=symbol*num_symbols+(0<=pos && pos<(long long)cells.size() ? cells[pos] : 0);
+        }
+        return symbol;
+    };
+    // The blocks right behind the head are held in the state.
+    std::vector<int> held;
+    for (int j=1; j<=num_held; j++) held.push_back(get_block(-j*ahead));
+    int state=this->machine->make_state(base_state,held);
+    if (state<0) return 0;
+    auto push_block=[](std::vector<RepeatedSymbol>& half_tape,int symbol) {
+        RepeatedSymbol& top=half_tape.back();
+        // Blanks next to the infinite end merge into it.
+        if (top.symbol==symbol) top.num=top.num+1;
+        else half_tape.push_back({symbol,1});
+    };
+    // Enough blocks on each side to cover every cell, pushed from the far end.
+    long long num_blocks=(long long)cells.size()/width+num_held+2;
+    this->tape=ChainTape(this->machine->init_symbol,dir);
+    for (long long j=num_blocks; j>=0; j--) push_block(this->tape.tape[dir],get_block(j*ahead));
+    for (long long j=num_blocks; j>num_held; j--) push_block(this->tape.tape[!dir],get_block(-j*ahead));
+    this->dir=dir;
+    this->state=state;
+    this->step_num=XInteger{fmpz_class(num_steps)};
+    return 1;
+}
+
 // todo: need to keep Simulator::step and GeneralSimulator::step in sync
 void Simulator::step() {
     if (this->op_state != RUNNING) return;
-    this->old_step_num=this->step_num;
+    if (const char* reason=this->repeat_detector.check(this->state,this->tape,this->num_loops,this->num_rule_moves)) {
+        this->op_state=INF_REPEAT;
+        this->inf_reason=reason;
+        return;
+    }
+    bool compute_steps=this->options.compute_steps;
+    if (compute_steps) this->old_step_num=this->step_num;
     // Note: We increment the number of loops early to take care of all the
     // places step() could early-return.
     this->num_loops++;
+    bool after_chain=this->last_was_chain;
+    this->last_was_chain=0;
 
-    if (1) { // todo: switch prover on/off?
+    if (this->prover.should_log(this->tape,this->state,after_chain,this->num_loops-1)) {
         // Log the configuration in the prover and apply rule if possible.
         ProverResult prover_result=this->prover.log_and_apply(
             this->tape,this->state,this->step_num,this->num_loops-1);
         if (std::get_if<ProverResultNothingToDo>(&prover_result)) {}
         else if (auto apply_rule=std::get_if<ProverResultApplyRule>(&prover_result)) {
-            // Proof system says that we can apply a rule
-            this->tape=apply_rule->new_tape;
+            // Proof system applied a rule to our tape
             this->num_rule_moves++;
-            this->step_num=this->step_num+apply_rule->num_base_steps;
+            if (compute_steps) this->step_num+=apply_rule->num_base_steps;
+            record_flight_event(FLIGHT_RULE,this->state,flight_blocks(this->tape),max_flight_bits(this->tape));
             return;
         }
         else if (std::get_if<ProverResultInfRepeat>(&prover_result)) {
@@ -54,7 +102,7 @@ void Simulator::step() {
     }
     // Chain move
     else if (trans.state_out==this->state && trans.dir_out == this->dir && this->op_state==RUNNING) {
-        XInteger num_reps=this->tape.apply_chain_move(trans.symbol_out);
+        XInteger num_reps=this->tape.apply_chain_move(trans.symbol_out,trans.num_out);
         if (num_reps.is_inf()) {
             this->op_state=INF_REPEAT;
             this->inf_reason="INF_CHAIN_STEP";
@@ -62,45 +110,82 @@ void Simulator::step() {
         }
         // Don't need to change state or direction
         this->num_chain_moves++;
-        this->step_num=this->step_num+num_reps*trans.num_base_steps;
+        this->last_was_chain=1;
+        if (compute_steps) this->step_num.add_mul(num_reps,trans.num_base_steps);
+        if (this->patterns) this->tape.compress_patterns(*this->patterns);
+        record_flight_event(FLIGHT_CHAIN,this->state,flight_blocks(this->tape),flight_bits(num_reps));
     }
     // Simple move
     else if (this->op_state!=OVER_STEPS_IN_MACRO) {
-        this->tape.apply_single_move(trans.symbol_out,trans.dir_out);
+        uint32_t count_bits=flight_bits(this->tape.tape[this->dir].back().num);
+        this->tape.apply_single_move(trans.symbol_out,trans.dir_out,trans.num_out);
         this->state=trans.state_out;
         this->dir=trans.dir_out;
         this->num_macro_moves++;
-        this->step_num=this->step_num+trans.num_base_steps;
+        if (compute_steps) this->step_num+=trans.num_base_steps;
+        if (this->patterns) this->tape.compress_patterns(*this->patterns);
+        record_flight_event(FLIGHT_MACRO,this->state,flight_blocks(this->tape),count_bits);
     }
     else assert(0); // unreachable?
 }
 
+XInteger Simulator::num_nonzero() const {
+    XInteger total{mpz0};
+    for (Dir dir:{LEFT,RIGHT}) {
+        for (auto& block:this->tape.tape[dir]) {
+            if (block.num.is_inf()) continue; // infinite blank end
+            if (int cnt=this->machine->num_nonzero(block.symbol)) total.add_mul(block.num,XInteger{fmpz_class(cnt)});
+        }
+    }
+    total+=this->machine->state_num_nonzero(this->state);
+    return total;
+}
+
+double Simulator::elapsed_time() const {
+    return (std::chrono::time_point_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now()).time_since_epoch().count()-this->start_time)/1e9;
+}
+
 void Simulator::print_self(bool full) const {
     //num_loops,num_macro_moves,num_chain_moves,num_rule_moves
     std::cout<<"\n";
-    std::cout<<"Elapsed time: "<<(std::chrono::time_point_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now()).time_since_epoch().count()-this->start_time)/1e9<<"\n";
+    std::cout<<"Elapsed time: "<<this->elapsed_time()<<"\n";
     this->tape.print_with_state(this->machine->head_to_string(this->state,this->dir),this->machine->symbol_to_string(),full);
-    std::cout<<"Total steps:  "<<this->step_num.to_string()<<"\n";
+    if (this->options.compute_steps) std::cout<<"Total steps:  "<<this->step_num.to_string()<<"\n";
+    else std::cout<<"Total steps:  (not computed)\n";
+    std::cout<<"Non-blank:    "<<this->num_nonzero().to_string()<<"\n";
     std::cout<<"Loops:        "<<this->num_loops<<"\n";
     std::cout<<"Macro moves:  "<<this->num_macro_moves<<"\n";
     std::cout<<"Chain moves:  "<<this->num_chain_moves<<"\n";
     std::cout<<"Rule moves:   "<<this->num_rule_moves<<"\n";
     std::cout<<"Rule proven:  "<<this->prover.rules.size()<<"\n";
-    std::cout<<"Elapsed time: "<<(std::chrono::time_point_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now()).time_since_epoch().count()-this->start_time)/1e9<<"\n";
+    std::cout<<"Failed proofs: "<<this->prover.num_failed_proofs<<"\n";
+    if (this->prover.num_skipped_proofs) std::cout<<"Skipped proofs: "<<this->prover.num_skipped_proofs<<"\n";
+    if (this->prover.num_successor_hits || this->prover.num_successor_misses) {
+        std::cout<<"Rule links:   "<<this->prover.num_successor_hits<<" hits, "<<this->prover.num_successor_misses<<" misses\n";
+    }
+    if (this->options.log_policy!=LOG_ALWAYS) {
+        std::cout<<"Prover logs:  "<<this->prover.num_logged<<" (skipped: "
+            <<this->prover.num_skipped_events<<" events, "
+            <<this->prover.num_skipped_chain<<" chain, "
+            <<this->prover.num_skipped_backoff<<" backoff)\n";
+    }
+    std::cout<<"Elapsed time: "<<this->elapsed_time()<<"\n";
 }
 
-GeneralSimulator::GeneralSimulator(BacksymbolMacroMachine* machine,int state,const GeneralChainTape& tape) :
+GeneralSimulator::GeneralSimulator(TuringMachine* machine,int state,const GeneralChainTape& tape,bool compute_steps) :
     machine{machine},
     state{state},
     dir{tape.dir},
-    tape{tape} {
+    tape{tape},
+    patterns{machine->pattern_machine()},
+    compute_steps{compute_steps} {
         //
     }
 
 // todo: need to keep Simulator::step and GeneralSimulator::step in sync
 void GeneralSimulator::step() {
     if (this->op_state != RUNNING) return;
-    this->old_step_num=this->step_num;
+    if (this->compute_steps) this->old_step_num=this->step_num;
     // Note: We increment the number of loops early to take care of all the
     // places step() could early-return.
     this->num_loops++;
@@ -117,21 +202,23 @@ void GeneralSimulator::step() {
     }
     // Chain move
     else if (trans.state_out==this->state && trans.dir_out == this->dir && this->op_state==RUNNING) {
-        VarPlusXInteger num_reps=this->tape.apply_chain_move(trans.symbol_out);
+        VarPlusXInteger num_reps=this->tape.apply_chain_move(trans.symbol_out,trans.num_out);
         if (num_reps.num.is_inf()) {
             this->op_state=INF_REPEAT;
             this->inf_reason="INF_CHAIN_STEP";
             return;
         }
         // Don't need to change state or direction
-        this->step_num=this->step_num+num_reps*trans.num_base_steps;
+        if (this->compute_steps) this->step_num=this->step_num+num_reps*trans.num_base_steps;
+        if (this->patterns) this->tape.compress_patterns(*this->patterns);
     }
     // Simple move
     else if (this->op_state!=OVER_STEPS_IN_MACRO) {
-        this->tape.apply_single_move(trans.symbol_out,trans.dir_out);
+        this->tape.apply_single_move(trans.symbol_out,trans.dir_out,trans.num_out);
         this->state=trans.state_out;
         this->dir=trans.dir_out;
-        this->step_num=this->step_num+trans.num_base_steps;
+        if (this->compute_steps) this->step_num=this->step_num+trans.num_base_steps;
+        if (this->patterns) this->tape.compress_patterns(*this->patterns);
     }
     else assert(0); // unreachable?
 }
@@ -1,19 +1,25 @@
 #pragma once
+#include "options.h"
 #include "prover.h"
+#include "repeat_detector.h"
 #include "tape.h"
 #include "turing_machine.h"
 #include "x_integer.h"
 
 struct Simulator {
-    BacksymbolMacroMachine* machine; // todo: support other machines
+    TuringMachine* machine;
     int state;
     Dir dir;
 
     XInteger old_step_num{0},step_num{0};
 
     ChainTape tape;
+    PatternMacroMachine* patterns; // machine->pattern_machine()
 
     ProofSystem prover;
+    RepeatDetector repeat_detector;
+    SimOptions options;
+    bool last_was_chain=0; // was the previous loop a chain move?
 
     // Operation state (e.g. running, halted, proven-infinite, ...)
     RunCondition op_state=RUNNING;
@@ -24,23 +30,36 @@ struct Simulator {
     long long num_loops=0,num_macro_moves=0,num_chain_moves=0,num_rule_moves=0;
     std::string inf_reason; // doesn't need to be enum yet
 
-    Simulator(BacksymbolMacroMachine* machine); // todo: support other machines
+    Simulator(TuringMachine* machine,const SimOptions& options={});
+
+    // Start from a base machine configuration (e.g. from detect_cycler)
+    // instead of the blank tape. The head is on cells[head] and just entered
+    // its block from direction dir. Cells outside `cells` are blank.
+    // False (and nothing changes) if the machine stack can't be seeded.
+    bool seed(int base_state,Dir dir,const std::vector<uint8_t>& cells,long long head,long long num_steps);
 
     // Perform an atomic transition or chain step.
     void step();
 
+    // Seconds since the simulator was created.
+    double elapsed_time() const;
+
+    // Number of non-blank base symbols on the tape (including backsymbols).
+    XInteger num_nonzero() const;
+
     void print_self(bool full=false) const;
 };
 
 // a version of Simulator used by gen_sim in ProofSystem.prove_rule
 struct GeneralSimulator {
-    BacksymbolMacroMachine* machine; // todo: support other machines
+    TuringMachine* machine;
     int state;
     Dir dir;
 
     VarPlusXInteger old_step_num{{},0},step_num{{},0};
 
     GeneralChainTape tape;
+    PatternMacroMachine* patterns; // machine->pattern_machine()
 
     // Operation state (e.g. running, halted, proven-infinite, ...)
     RunCondition op_state=RUNNING;
@@ -50,8 +69,9 @@ struct GeneralSimulator {
     long long num_loops=0;
     std::string inf_reason; // doesn't need to be enum yet
 
-    // todo: support other machines
-    GeneralSimulator(BacksymbolMacroMachine* machine,int state,const GeneralChainTape& tape);
+    bool compute_steps;
+
+    GeneralSimulator(TuringMachine* machine,int state,const GeneralChainTape& tape,bool compute_steps=true);
 
     // Perform an atomic transition or chain step.
     void step();
@@ -1,4 +1,5 @@
 #include "tape.h"
+#include "turing_machine.h"
 #include <iostream>
 
 std::string RepeatedSymbol::to_string(std::function<std::string(int)> symbol_to_string) const {
@@ -8,7 +9,7 @@ std::string RepeatedSymbol::to_string(std::function<std::string(int)> symbol_to_
     return s;
 }
 
-XInteger ChainTape::apply_chain_move(int new_symbol) {
+XInteger ChainTape::apply_chain_move(int new_symbol,int num_out) {
     // Pop off old sequence
     XInteger num=this->tape[this->dir].back().num;
     // Can't pop off infinite symbols, TM will never halt
@@ -17,12 +18,13 @@ XInteger ChainTape::apply_chain_move(int new_symbol) {
     // Push on new one behind us
     std::vector<RepeatedSymbol>& half_tape=this->tape[!this->dir];
     RepeatedSymbol& top=half_tape.back();
-    if (top.symbol==new_symbol) top.num=top.num+num;
-    else half_tape.push_back({new_symbol,num});
+    XInteger num_written=(num_out==1 ? num : num*num_out);
+    if (top.symbol==new_symbol) top.num+=num_written;
+    else half_tape.push_back({new_symbol,num_written});
     return num;
 }
 
-void ChainTape::apply_single_move(int new_symbol,Dir new_dir) {
+void ChainTape::apply_single_move(int new_symbol,Dir new_dir,int num_out) {
     {
         // Delete old symbol
         std::vector<RepeatedSymbol>& half_tape=this->tape[this->dir];
@@ -37,14 +39,106 @@ void ChainTape::apply_single_move(int new_symbol,Dir new_dir) {
         std::vector<RepeatedSymbol>& half_tape=this->tape[!new_dir];
         RepeatedSymbol& top=half_tape.back();
         // If it is identical to the top symbol, combine them.
-        if (top.symbol==new_symbol) top.num=top.num+1;
+        if (top.symbol==new_symbol) top.num=top.num+num_out;
         // Otherwise, just add it separately.
-        else half_tape.push_back({new_symbol,1});
+        else half_tape.push_back({new_symbol,num_out});
     }
     // Update direction
     this->dir=new_dir;
 }
 
+// Count of a block if it is a constant of at most MAX_PATTERN_SYMBOLS, else 0.
+int small_count(const XInteger& num) {
+    if (!num.num || fmpz_cmp_si(num.num.value().num,MAX_PATTERN_SYMBOLS)>0) return 0;
+    return fmpz_get_si(num.num.value().num);
+}
+int small_count(const VarPlusXInteger& num) {
+    return num.var.empty() ? small_count(num.num) : 0;
+}
+
+void set_count(XInteger& num,int count) {
+    num=XInteger{fmpz_class((slong)count)};
+}
+void set_count(VarPlusXInteger& num,int count) {
+    num={{},XInteger{fmpz_class((slong)count)}};
+}
+
+// Shared by ChainTape and GeneralChainTape. Block i of half_tape is
+// half_tape[i], the top one is nearest the head and block 0 is the infinite end.
+template<class Block>
+bool compress_half_tape(PatternMacroMachine& patterns,std::vector<Block>& half_tape,Dir half) {
+    int top=half_tape.size()-1;
+    auto length=[&](int symbol) {
+        const std::vector<int>* symbols=patterns.pattern(symbol);
+        return symbols ? (int)symbols->size() : 1;
+    };
+    // The base symbols of blocks first..top, left to right.
+    auto expand=[&](int first) {
+        std::vector<int> out;
+        for (int j=first; j<=top; j++) {
+            const Block& block=half_tape[half==LEFT ? j : top+first-j];
+            const std::vector<int>* symbols=patterns.pattern(block.symbol);
+            for (int n=small_count(block.num); n>0; n--) {
+                if (symbols) out.insert(out.end(),symbols->begin(),symbols->end());
+                else out.push_back(block.symbol);
+            }
+        }
+        return out;
+    };
+
+    // Fold: the blocks on top spell out the pattern right below them.
+    int num_symbols=0;
+    for (int i=top; i>=1; i--) {
+        const std::vector<int>* symbols=patterns.pattern(half_tape[i].symbol);
+        if (symbols && i<top && num_symbols==symbols->size() && expand(i+1)==*symbols) {
+            half_tape.resize(i+1);
+            half_tape[i].num=half_tape[i].num+1;
+            return 1;
+        }
+        int count=small_count(half_tape[i].num);
+        if (!count) break;
+        num_symbols+=count*length(half_tape[i].symbol);
+        if (num_symbols>MAX_PATTERN_SYMBOLS) break;
+    }
+
+    // New pattern: the top k blocks repeat right below. Adjacent blocks have
+    // different symbols, so it takes k>=2.
+    num_symbols=0;
+    for (int k=1; 2*k<=top; k++) {
+        int count=small_count(half_tape[top-k+1].num);
+        if (!count) break;
+        num_symbols+=count*length(half_tape[top-k+1].symbol);
+        if (num_symbols>MAX_PATTERN_SYMBOLS) break;
+        if (k<2) continue;
+        bool repeats=1;
+        for (int j=0; j<k && repeats; j++) {
+            const Block& a=half_tape[top-j];
+            const Block& b=half_tape[top-k-j];
+            repeats=(a.symbol==b.symbol && small_count(b.num)==small_count(a.num));
+        }
+        if (!repeats) continue;
+        auto [symbol,copies]=patterns.intern(expand(top-k+1));
+        half_tape.resize(top-2*k+1);
+        if (half_tape.back().symbol==symbol) half_tape.back().num=half_tape.back().num+2*copies;
+        else {
+            Block block{};
+            block.symbol=symbol;
+            set_count(block.num,2*copies);
+            half_tape.push_back(block);
+        }
+        return 1;
+    }
+    return 0;
+}
+
+bool ChainTape::compress_patterns(PatternMacroMachine& patterns) {
+    return compress_half_tape(patterns,this->tape[!this->dir],(Dir)!this->dir);
+}
+
+bool GeneralChainTape::compress_patterns(PatternMacroMachine& patterns) {
+    return compress_half_tape(patterns,this->tape[!this->dir],(Dir)!this->dir);
+}
+
 const int CUTOFF=3; // todo: increase to 30
 void ChainTape::print_with_state(std::string head,std::function<std::string(int)> symbol_to_string,bool full) const {
     XInteger blocks{0};
@@ -116,7 +210,7 @@ GeneralChainTape::GeneralChainTape(const ChainTape& chain_tape,std::map<int,XInt
         }
     }
 
-VarPlusXInteger GeneralChainTape::apply_chain_move(int new_symbol) {
+VarPlusXInteger GeneralChainTape::apply_chain_move(int new_symbol,int num_out) {
     // Pop off old sequence
     VarPlusXInteger num=this->tape[this->dir].back().num;
     // Can't pop off infinite symbols, TM will never halt
@@ -125,12 +219,13 @@ VarPlusXInteger GeneralChainTape::apply_chain_move(int new_symbol) {
     // Push on new one behind us
     std::vector<GeneralRepeatedSymbol>& half_tape=this->tape[!this->dir];
     GeneralRepeatedSymbol& top=half_tape.back();
-    if (top.symbol==new_symbol) top.num=top.num+num;
-    else half_tape.push_back({0,new_symbol,num});
+    VarPlusXInteger num_written=(num_out==1 ? num : num*XInteger{fmpz_class((slong)num_out)});
+    if (top.symbol==new_symbol) top.num=top.num+num_written;
+    else half_tape.push_back({0,new_symbol,num_written});
     return num;
 }
 
-void GeneralChainTape::apply_single_move(int new_symbol,Dir new_dir) {
+void GeneralChainTape::apply_single_move(int new_symbol,Dir new_dir,int num_out) {
     {
         // Delete old symbol
         std::vector<GeneralRepeatedSymbol>& half_tape=this->tape[this->dir];
@@ -145,9 +240,9 @@ void GeneralChainTape::apply_single_move(int new_symbol,Dir new_dir) {
         std::vector<GeneralRepeatedSymbol>& half_tape=this->tape[!new_dir];
         GeneralRepeatedSymbol& top=half_tape.back();
         // If it is identical to the top symbol, combine them.
-        if (top.symbol==new_symbol) top.num=top.num+1;
+        if (top.symbol==new_symbol) top.num=top.num+num_out;
         // Otherwise, just add it separately.
-        else half_tape.push_back({0,new_symbol,{{},mpz1}});
+        else half_tape.push_back({0,new_symbol,{{},fmpz_class((slong)num_out)}});
     }
     // Update direction
     this->dir=new_dir;
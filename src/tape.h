@@ -4,6 +4,8 @@
 #include <functional>
 #include <map>
 
+struct PatternMacroMachine;
+
 struct RepeatedSymbol {
     int symbol;
     XInteger num;
@@ -23,12 +25,18 @@ struct ChainTape {
         return this->tape[this->dir].back().symbol;
     }
 
-    // Apply a chain step which replaces an entire string of symbols.
-    // Returns the number of symbols replaced.
-    XInteger apply_chain_move(int new_symbol);
+    // Apply a chain step which replaces an entire string of symbols, each
+    // with num_out copies of new_symbol. Returns the number of symbols replaced.
+    XInteger apply_chain_move(int new_symbol,int num_out=1);
+
+    // Apply a single macro step. del old symbol, push num_out new ones.
+    void apply_single_move(int new_symbol,Dir new_dir,int num_out=1);
 
-    // Apply a single macro step. del old symbol, push new one.
-    void apply_single_move(int new_symbol,Dir new_dir);
+    // Replace a repeated sequence of blocks on top of the half tape behind
+    // the head with one block of a pattern symbol, e.g. a^1 b^2 a^1 b^2 ->
+    // (abb)^2, or fold one more copy into the pattern block below it, e.g.
+    // (abb)^2 a^1 b^2 -> (abb)^3. Returns whether the tape changed.
+    bool compress_patterns(PatternMacroMachine& patterns);
 
     void print_with_state(std::string head,std::function<std::string(int)> symbol_to_string,bool full) const;
 };
@@ -55,12 +63,15 @@ struct GeneralChainTape {
         return this->tape[this->dir].back().symbol;
     }
 
-    // Apply a chain step which replaces an entire string of symbols.
-    // Returns the number of symbols replaced.
-    VarPlusXInteger apply_chain_move(int new_symbol);
+    // Like ChainTape::apply_chain_move.
+    VarPlusXInteger apply_chain_move(int new_symbol,int num_out=1);
+
+    // Like ChainTape::apply_single_move.
+    void apply_single_move(int new_symbol,Dir new_dir,int num_out=1);
 
-    // Apply a single macro step. del old symbol, push new one.
-    void apply_single_move(int new_symbol,Dir new_dir);
+    // Like ChainTape::compress_patterns. Only blocks with constant counts
+    // are compressed (the pattern block folded into may be general).
+    bool compress_patterns(PatternMacroMachine& patterns);
 
     void print_with_state(std::string head,std::function<std::string(int)> symbol_to_string) const;
 };
@@ -0,0 +1,84 @@
+#include "trans_cache.h"
+#include <bit>
+
+const int MAX_LOAD=2; // entries per bucket before the table doubles
+
+// Initially between 16 and 65536 buckets, about one per key.
+int bucket_bits(uint64_t key_space) {
+    int bits=4;
+    while (bits<16 && (1ULL<<bits)<key_space) bits++;
+    return bits;
+}
+
+TransCache::Table::Table(int bits) :
+        mask{(1ULL<<bits)-1},
+        buckets{new std::atomic<Link*>[1ULL<<bits]} {
+    for (uint64_t i=0; i<=this->mask; i++) this->buckets[i].store(nullptr,std::memory_order_relaxed);
+}
+
+TransCache::Table::~Table() {
+    for (uint64_t i=0; i<=this->mask; i++) {
+        for (Link* l=this->buckets[i].load(std::memory_order_relaxed); l;) {
+            Link* next=l->next;
+            delete l;
+            l=next;
+        }
+    }
+}
+
+void TransCache::Table::push(Entry* entry) {
+    std::atomic<Link*>& bucket=this->buckets[hash(entry->key)&this->mask];
+    bucket.store(new Link{entry->key,entry,bucket.load(std::memory_order_relaxed)},std::memory_order_release);
+}
+
+TransCache::TransCache(uint64_t key_space) {
+    this->tables.push_back(std::make_unique<Table>(bucket_bits(key_space)));
+    this->table.store(this->tables.back().get(),std::memory_order_relaxed);
+}
+
+TransCache::~TransCache() {
+    // Every entry is in the newest table.
+    Table* table=this->table.load(std::memory_order_relaxed);
+    for (uint64_t i=0; i<=table->mask; i++) {
+        for (Link* l=table->buckets[i].load(std::memory_order_relaxed); l; l=l->next) delete l->entry;
+    }
+}
+
+TransCache::TransCache(const TransCache& other) {
+    const Table* from=other.table.load(std::memory_order_acquire);
+    this->tables.push_back(std::make_unique<Table>(std::countr_one(from->mask)));
+    Table* table=this->tables.back().get();
+    for (uint64_t i=0; i<=from->mask; i++) {
+        for (Link* l=from->buckets[i].load(std::memory_order_acquire); l; l=l->next) {
+            if (!l->entry->ready.load(std::memory_order_acquire)) continue;
+            Entry* copy=new Entry(l->key);
+            copy->trans=l->entry->trans;
+            copy->ready.store(1,std::memory_order_relaxed);
+            table->push(copy);
+            this->num_entries++;
+        }
+    }
+    this->table.store(table,std::memory_order_relaxed);
+}
+
+TransCache::Entry* TransCache::insert(uint64_t key,bool& inserted) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    Table* table=this->table.load(std::memory_order_relaxed);
+    // Another thread may have inserted it since our lookup.
+    if (Entry* entry=table->find(key)) {
+        inserted=0;
+        return entry;
+    }
+    Entry* entry=new Entry(key);
+    table->push(entry);
+    inserted=1;
+    if (++this->num_entries>MAX_LOAD*(table->mask+1)) {
+        auto grown=std::make_unique<Table>(std::countr_one(table->mask)+1);
+        for (uint64_t i=0; i<=table->mask; i++) {
+            for (Link* l=table->buckets[i].load(std::memory_order_relaxed); l; l=l->next) grown->push(l->entry);
+        }
+        this->table.store(grown.get(),std::memory_order_release);
+        this->tables.push_back(std::move(grown));
+    }
+    return entry;
+}
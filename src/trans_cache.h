@@ -0,0 +1,92 @@
+#pragma once
+#include "transition.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// A lazily filled transition table that many threads can share.
+// Lookups never take a lock. On a miss, the first thread to publish a
+// placeholder computes the entry exactly once. Other threads asking for the
+// same key wait until it is published.
+// Entries are never removed, so returned references stay valid. The bucket
+// array doubles past 2 entries per bucket: the new one links the same
+// entries, and old ones are kept until destruction for readers still in them.
+struct TransCache {
+    struct Entry {
+        uint64_t key;
+        std::atomic<bool> ready{0};
+        Transition trans;
+
+        Entry(uint64_t key) : key{key} {}
+    };
+    struct Link {
+        uint64_t key;
+        Entry* entry;
+        Link* next;
+    };
+    struct Table {
+        uint64_t mask;
+        std::unique_ptr<std::atomic<Link*>[]> buckets;
+
+        Table(int bits);
+        ~Table();
+        Table(const Table&)=delete;
+        Table& operator=(const Table&)=delete;
+
+        Entry* find(uint64_t key) const {
+            for (Link* l=this->buckets[hash(key)&this->mask].load(std::memory_order_acquire); l; l=l->next) {
+                if (l->key==key) return l->entry;
+            }
+            return nullptr;
+        }
+        // Only under TransCache::mutex.
+        void push(Entry* entry);
+    };
+
+    std::atomic<Table*> table; // the newest of tables
+    std::vector<std::unique_ptr<Table>> tables;
+    std::mutex mutex; // guards inserts and growing
+    uint64_t num_entries=0;
+
+    // key_space is an upper bound on the number of distinct keys. It only
+    // picks the initial number of buckets.
+    TransCache(uint64_t key_space);
+    ~TransCache();
+    // Copies the published entries. Not safe while another thread is inserting.
+    TransCache(const TransCache& other);
+    TransCache& operator=(const TransCache&)=delete;
+
+    // Return the transition for key, calling compute() to fill it in on a miss.
+    template<class F>
+    const Transition& get(uint64_t key,F compute) {
+        if (Entry* entry=this->table.load(std::memory_order_acquire)->find(key)) return wait_ready(entry);
+        // Miss. Publish a placeholder so only one thread computes this key.
+        bool inserted;
+        Entry* entry=this->insert(key,inserted);
+        if (!inserted) return wait_ready(entry);
+        entry->trans=compute();
+        entry->ready.store(1,std::memory_order_release);
+        entry->ready.notify_all();
+        return entry->trans;
+    }
+
+    // The entry for key, a new placeholder (inserted=1) if there is none.
+    Entry* insert(uint64_t key,bool& inserted);
+
+    static uint64_t hash(uint64_t key) {
+        // splitmix64 finalizer
+        key^=key>>30;
+        key*=0xbf58476d1ce4e5b9ULL;
+        key^=key>>27;
+        key*=0x94d049bb133111ebULL;
+        key^=key>>31;
+        return key;
+    }
+
+    static const Transition& wait_ready(const Entry* entry) {
+        while (!entry->ready.load(std::memory_order_acquire)) entry->ready.wait(0,std::memory_order_acquire);
+        return entry->trans;
+    }
+};
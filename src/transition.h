@@ -1,5 +1,6 @@
 #pragma once
 #include "x_integer.h"
+#include <string>
 #include <vector>
 
 enum Dir {
@@ -16,6 +17,17 @@ enum RunCondition {
     OVER_STEPS_IN_MACRO, // ?
 };
 
+inline std::string run_condition_to_string(RunCondition condition) {
+    switch (condition) {
+        case RUNNING: return "RUNNING";
+        case HALT: return "HALT";
+        case INF_REPEAT: return "INF_REPEAT";
+        case UNDEFINED: return "UNDEFINED";
+        case OVER_STEPS_IN_MACRO: return "OVER_STEPS_IN_MACRO";
+    }
+    return "?";
+}
+
 // Class representing the result of a transition.
 struct Transition {
     RunCondition condition;
@@ -24,4 +36,5 @@ struct Transition {
     int state_out; // not an optional<int> :(
     Dir dir_out;
     XInteger num_base_steps;
+    int num_out=1; // copies of symbol_out written (see PatternMacroMachine)
 };
@@ -1,5 +1,7 @@
 #include "turing_machine.h"
 #include <cassert>
+#include <bit>
+#include <climits>
 #include <tuple>
 
 SimpleMachine tmFromQuintuples(
@@ -29,7 +31,7 @@ SimpleMachine tmFromQuintuples(
     return SimpleMachine(ttable,num_states,num_symbols);
 }
 
-SimpleMachine parseTM(const std::string& line) {
+std::optional<SimpleMachine> tryParseTM(const std::string& line) {
     // Read transition table given a standard text representation.
     std::vector<std::tuple<int,int,int,Dir,int>> quints;
     std::vector<std::string> rows;
@@ -45,30 +47,62 @@ SimpleMachine parseTM(const std::string& line) {
         rows.push_back(token);
     }
     int num_states=rows.size();
-    int max_symbol=0;
+    int num_symbols=rows.at(0).size()/3;
+    if (num_symbols==0 || num_symbols>10) return std::nullopt;
     for (int state_in=0; state_in<rows.size(); state_in++) {
         std::string row=rows.at(state_in);
-        for (int symbol_in=0; symbol_in*3<row.size(); symbol_in++) {
-            max_symbol=std::max(max_symbol,symbol_in);
+        if (row.size()!=num_symbols*3) return std::nullopt;
+        for (int symbol_in=0; symbol_in<num_symbols; symbol_in++) {
             std::string trans_str=row.substr(symbol_in*3,3);
-            assert(trans_str.size()==3);
             if (trans_str=="---") continue;
-            assert('0'<=trans_str.at(0) && trans_str.at(0)<='9');
+            if (!('0'<=trans_str.at(0) && trans_str.at(0)<'0'+num_symbols)) return std::nullopt;
             int symbol_out=trans_str.at(0)-'0';
-            assert(trans_str.at(1)=='L' || trans_str.at(1)=='R');
+            if (trans_str.at(1)!='L' && trans_str.at(1)!='R') return std::nullopt;
             Dir dir_out=(trans_str.at(1)=='L' ? LEFT : RIGHT);
-            assert('A'<=trans_str.at(2) && trans_str.at(2)<='Z');
+            if (!('A'<=trans_str.at(2) && trans_str.at(2)<='Z')) return std::nullopt;
             int state_out=trans_str.at(2)-'A';
             if (state_out>=num_states) state_out=-1;
             quints.emplace_back(state_in,symbol_in,symbol_out,dir_out,state_out);
         }
     }
 
-    return tmFromQuintuples(quints,num_states,max_symbol+1);
+    return tmFromQuintuples(quints,num_states,num_symbols);
+}
+
+SimpleMachine parseTM(const std::string& line) {
+    std::optional<SimpleMachine> machine=tryParseTM(line);
+    assert(machine.has_value());
+    return std::move(machine.value());
+}
+
+std::string tmToString(const SimpleMachine& machine) {
+    std::string s;
+    for (int state=0; state<machine.num_states; state++) {
+        if (state>0) s+="_";
+        for (int symbol=0; symbol<machine.num_symbols; symbol++) {
+            const Transition& trans=machine.ttable[state][symbol];
+            if (trans.condition==UNDEFINED) {
+                s+="---";
+                continue;
+            }
+            s.push_back('0'+trans.symbol_out);
+            s.push_back(trans.dir_out==LEFT ? 'L' : 'R');
+            s.push_back(trans.condition==HALT ? 'Z' : 'A'+trans.state_out);
+        }
+    }
+    return s;
 }
 
 // Simulate TM on a limited tape segment.
 // Can detect HALT and INF_REPEAT. Used by Macro Machines.
+// The block symbol for tape, tape[0] lowest. Wraps around for tapes too big
+// for a block symbol (e.g. patterns), whose callers use the tape instead.
+int pack_symbols(const TuringMachine& tm,const std::vector<int>& tape) {
+    unsigned symbol=0;
+    for (int i=tape.size(); i>0; i--) symbol=symbol*tm.num_symbols+tape.at(i-1);
+    return symbol;
+}
+
 std::pair<Transition,std::vector<int>> sim_limited(
     TuringMachine& tm,
     int state,
@@ -96,8 +130,7 @@ std::pair<Transition,std::vector<int>> sim_limited(
 
         if (std::tuple<int,std::vector<int>,Dir,int>{state,tape,dir,pos}==old_config) {
             // Found a repeated config.
-            int symbol=0;
-            for (int i=tape.size(); i>0; i--) symbol=symbol*tm.num_symbols+tape.at(i-1);
+            int symbol=pack_symbols(tm,tape);
             return {{INF_REPEAT,{pos},symbol,state,dir,num_base_steps},tape};
         }
         if (num_loops>=next_config_save) {
@@ -107,127 +140,259 @@ std::pair<Transition,std::vector<int>> sim_limited(
 
         if (trans.condition!=RUNNING) {
             // Base machine stopped running (HALT, INF_REPEAT, etc.)
-            int symbol=0;
-            for (int i=tape.size(); i>0; i--) symbol=symbol*tm.num_symbols+tape.at(i-1);
+            int symbol=pack_symbols(tm,tape);
             std::vector<int> condition_details=trans.condition_details;
             condition_details.push_back(pos);
             return {{trans.condition,condition_details,symbol,state,dir,num_base_steps},tape};
         }
         if (!(0<=pos && pos<tape.size())) {
             // We ran off one end of the macro symbol. We're done.
-            int symbol=0;
-            for (int i=tape.size(); i>0; i--) symbol=symbol*tm.num_symbols+tape.at(i-1);
+            int symbol=pack_symbols(tm,tape);
             return {{RUNNING,{},symbol,state,dir,num_base_steps},tape};
         }
     }
     assert(0); // unreachable
 }
 
-BlockMacroMachine::BlockMacroMachine(SimpleMachine base_machine, int block_size) :
-        TuringMachine(base_machine.num_states,1),
+// b^e, saturating instead of overflowing
+uint64_t saturating_pow(uint64_t b,int e) {
+    uint64_t out=1;
+    for (int i=0; i<e; i++) out=(out>UINT64_MAX/b ? UINT64_MAX : out*b);
+    return out;
+}
+
+std::function<std::string(int)> SimpleMachine::symbol_to_string() const {
+    return [](int symbol) {
+        return std::string(1,'0'+symbol);
+    };
+}
+
+std::string SimpleMachine::head_to_string(int state,Dir dir) const {
+    char c=(state<0 ? 'Z' : 'A'+state);
+    if (dir==LEFT) return {'<',c};
+    return {c,'>'};
+}
+
+BlockMacroMachine::BlockMacroMachine(std::shared_ptr<TuringMachine> base_machine, int block_size) :
+        TuringMachine(base_machine->num_states,1),
         base_machine{base_machine},
         block_size{block_size},
-        init_state{base_machine.init_state},
-        init_symbol{0}, // assume init_symbol = 0
-        init_dir{base_machine.init_dir} {
+        trans_table{saturating_pow(base_machine->num_symbols,block_size)*base_machine->num_states*2} {
+    this->init_state=base_machine->init_state;
+    this->init_symbol=0; // assume init_symbol = 0
+    this->init_dir=base_machine->init_dir;
     for (int i=0; i<block_size; i++) {
-        assert(2e9/this->num_symbols/base_machine.num_symbols>=1); // prevent int overflow
-        this->num_symbols*=base_machine.num_symbols;
+        assert(2e9/this->num_symbols/base_machine->num_symbols>=1); // prevent int overflow
+        this->num_symbols*=base_machine->num_symbols;
     }
-    assert(2e9/this->num_states/this->num_symbols/2>=1); // prevent int overflow in get_trans_object
 }
 
 std::function<std::string(int)> BlockMacroMachine::symbol_to_string() const {
-    return [block_size=this->block_size,num_symbols=this->base_machine.num_symbols](int symbol) {
+    return [block_size=this->block_size,num_symbols=this->base_machine->num_symbols,base=this->base_machine->symbol_to_string()](int symbol) {
         std::string s;
         for (int i=0; i<block_size; i++) {
-            s.push_back('0'+symbol%num_symbols);
+            s+=base(symbol%num_symbols);
             symbol/=num_symbols;
         }
         return s;
     };
 }
 
-const Transition& BlockMacroMachine::get_trans_object(int symbol_in,int state_in,Dir dir) {
-    int hash=symbol_in*this->num_states*2+state_in*2+dir;
-    if (auto it=this->trans_table.find(hash); it!=this->trans_table.end()) return it->second;
-
-    std::vector<int> tape;
-    for (int h=symbol_in,i=0; i<block_size; h/=this->base_machine.num_symbols,i++) {
-        tape.push_back(h%this->base_machine.num_symbols);
+int BlockMacroMachine::num_nonzero(int symbol) const {
+    int cnt=0;
+    for (int i=0; i<this->block_size; i++) {
+        cnt+=this->base_machine->num_nonzero(symbol%this->base_machine->num_symbols);
+        symbol/=this->base_machine->num_symbols;
     }
-    int pos=(dir==RIGHT ? 0 : block_size-1);
-    return this->trans_table[hash]=sim_limited(this->base_machine,state_in,tape,dir,pos).first;
+    return cnt;
+}
+
+const Transition& BlockMacroMachine::get_trans_object(int symbol_in,int state_in,Dir dir) {
+    uint64_t hash=((uint64_t)symbol_in*this->num_states+state_in)*2+dir;
+    return this->trans_table.get(hash,[&]() {
+        std::vector<int> tape;
+        for (int h=symbol_in,i=0; i<block_size; h/=this->base_machine->num_symbols,i++) {
+            tape.push_back(h%this->base_machine->num_symbols);
+        }
+        int pos=(dir==RIGHT ? 0 : block_size-1);
+        return sim_limited(*this->base_machine,state_in,tape,dir,pos).first;
+    });
 }
 
-BacksymbolMacroMachine::BacksymbolMacroMachine(BlockMacroMachine base_machine) :
-        TuringMachine(base_machine.num_states+1,base_machine.num_symbols),
+BacksymbolMacroMachine::BacksymbolMacroMachine(std::shared_ptr<TuringMachine> base_machine) :
+        TuringMachine((base_machine->num_states+1)*base_machine->num_symbols,base_machine->num_symbols),
         base_machine{base_machine},
-        init_state{base_machine.init_state}, // assume backsymbol = 0
-        init_symbol{0}, // assume init_symbol = 0
-        init_dir{base_machine.init_dir} {
-    assert(2e9/this->num_symbols/this->num_states>=1); // prevent int overflow in get_trans_object hash.first
-    assert(2e9/this->num_symbols/2>=1); // prevent int overflow in get_trans_object hash.second
+        base_num_states{base_machine->num_states+1},
+        // state_in holds a backsymbol too
+        trans_table{(uint64_t)base_machine->num_symbols*(base_machine->num_states+1)*base_machine->num_symbols*2} {
+    this->init_state=base_machine->init_state; // assume backsymbol = 0
+    this->init_symbol=0; // assume init_symbol = 0
+    this->init_dir=base_machine->init_dir;
+    assert(2e9/this->num_symbols/this->base_num_states>=1); // prevent int overflow in states
+}
+
+std::pair<int,int> BacksymbolMacroMachine::split_state(int state) const {
+    if ((state+1)%this->base_num_states==0) return {(state+1)/this->base_num_states,-1}; // halt
+    return {state/this->base_num_states,state%this->base_num_states};
 }
 
 std::string BacksymbolMacroMachine::head_to_string(int state,Dir dir) const {
-    char base_state;
-    if ((state+1)%this->num_states==0) { // halt (this is a bit sketchy)
-        base_state='Z';
-        state++;
-    }
-    else base_state='A'+state%this->num_states;
-    std::string s;
-    if (dir==LEFT) {
-        s+="<";
-        s.push_back(base_state);
-        s+=" (";
-        s+=this->symbol_to_string()(state/this->num_states);
-        s+=")";
-    }
-    else {
-        s+="(";
-        s+=this->symbol_to_string()(state/this->num_states);
-        s+=") ";
-        s.push_back(base_state);
-        s+=">";
-    }
-    return s;
+    auto [backsymbol,base_state]=this->split_state(state);
+    std::string head=this->base_machine->head_to_string(base_state,dir);
+    std::string back=this->symbol_to_string()(backsymbol);
+    if (dir==LEFT) return head+" ("+back+")";
+    return "("+back+") "+head;
+}
+
+int BacksymbolMacroMachine::state_num_nonzero(int state) const {
+    auto [backsymbol,base_state]=this->split_state(state);
+    return this->base_machine->num_nonzero(backsymbol)+this->base_machine->state_num_nonzero(base_state);
+}
+
+int BacksymbolMacroMachine::make_state(int base_state,const std::vector<int>& held) const {
+    int state=this->base_machine->make_state(base_state,held);
+    if (state<0) return -1;
+    return held.at(this->base_machine->num_held_symbols())*this->base_num_states+state;
 }
 
 const Transition& BacksymbolMacroMachine::get_trans_object(int symbol_in,int state_in,Dir dir) {
-    std::pair<int,int> hash{state_in,symbol_in*2+dir};
-    if (auto it=this->trans_table.find(hash); it!=this->trans_table.end()) return it->second;
-
-    int base_state=state_in%this->num_states;
-    std::vector<int> tape;
-    int pos;
-    if (dir==RIGHT) {
-        tape={state_in/this->num_states,symbol_in};
-        pos=1;
+    uint64_t hash=((uint64_t)state_in*this->num_symbols+symbol_in)*2+dir;
+    return this->trans_table.get(hash,[&]() {
+        auto [backsymbol_in,base_state]=this->split_state(state_in);
+        std::vector<int> tape;
+        int pos;
+        if (dir==RIGHT) {
+            tape={backsymbol_in,symbol_in};
+            pos=1;
+        }
+        else {
+            tape={symbol_in,backsymbol_in};
+            pos=0;
+        }
+        auto [trans,tape2]=sim_limited(*this->base_machine,base_state,tape,dir,pos);
+        // sim_limited just leaves the final tape in `trans.symbol_out`, we
+        // need to split out the backsymbol and printed_symbol ourselves.
+        int symbol_out,backsymbol;
+        if (trans.dir_out==RIGHT) {
+            // [0, 1], A, RIGHT -> 0 (1)A>
+            symbol_out=tape2.at(0);
+            backsymbol=tape2.at(1);
+        }
+        else {
+            // [0, 1], A, LEFT -> <A(0) 1
+            backsymbol=tape2.at(0);
+            symbol_out=tape2.at(1);
+        }
+        // Update symbol_out and state_out to be backsymbol-style.
+        int state_out=backsymbol*this->base_num_states+trans.state_out;
+        trans.symbol_out=symbol_out;
+        trans.state_out=state_out;
+        return trans;
+    });
+}
+
+PatternMacroMachine::PatternMacroMachine(std::shared_ptr<TuringMachine> base_machine) :
+        TuringMachine(base_machine->num_states,base_machine->num_symbols),
+        base_machine{base_machine},
+        trans_table{1<<16} {
+    this->init_state=base_machine->init_state;
+    this->init_symbol=base_machine->init_symbol;
+    this->init_dir=base_machine->init_dir;
+}
+
+std::pair<int,int> PatternMacroMachine::intern(const std::vector<int>& symbols) {
+    assert(!symbols.empty() && symbols.size()<=MAX_PATTERN_SYMBOLS);
+    // The shortest period that divides the length.
+    int n=symbols.size(),period=1;
+    for (; period<n; period++) {
+        if (n%period!=0) continue;
+        bool repeats=1;
+        for (int i=period; i<n && repeats; i++) repeats=(symbols[i]==symbols[i-period]);
+        if (repeats) break;
     }
-    else {
-        tape={symbol_in,state_in/this->num_states};
-        pos=0;
+    if (period==1) return {symbols[0],n};
+    std::vector<int> word(symbols.begin(),symbols.begin()+period);
+    std::lock_guard<std::mutex> lock(this->patterns_mutex);
+    int index=this->num_patterns.load(std::memory_order_relaxed);
+    auto [it,inserted]=this->pattern_ids.emplace(word,this->num_symbols+index);
+    if (inserted) {
+        assert(it->second<INT_MAX); // prevent int overflow
+        int c=std::bit_width((unsigned)index+1)-1;
+        if (!this->pattern_chunks[c]) this->pattern_chunks[c]=std::make_unique<std::vector<int>[]>(1<<c);
+        this->pattern_chunks[c][index+1-(1<<c)]=std::move(word);
+        this->num_patterns.store(index+1,std::memory_order_release);
     }
-    auto [trans,tape2]=sim_limited(this->base_machine,base_state,tape,dir,pos);
-    // sim_limited just leaves the final tape in `trans.symbol_out`, we
-    // need to split out the backsymbol and printed_symbol ourselves.
-    int final_tape=trans.symbol_out;
-    int symbol_out,backsymbol;
-    if (trans.dir_out==RIGHT) {
-        // [0, 1], A, RIGHT -> 0 (1)A>
-        symbol_out=tape2.at(0);
-        backsymbol=tape2.at(1);
+    return {it->second,n/period};
+}
+
+const std::vector<int>* PatternMacroMachine::pattern(int symbol) const {
+    if (symbol<this->num_symbols) return nullptr;
+    int index=symbol-this->num_symbols;
+    // Acquire, so the pattern that was interned is visible here.
+    int num_patterns=this->num_patterns.load(std::memory_order_acquire);
+    assert(index<num_patterns);
+    (void)num_patterns;
+    int c=std::bit_width((unsigned)index+1)-1;
+    return &this->pattern_chunks[c][index+1-(1<<c)];
+}
+
+std::function<std::string(int)> PatternMacroMachine::symbol_to_string() const {
+    return [this,base=this->base_machine->symbol_to_string()](int symbol) {
+        const std::vector<int>* symbols=this->pattern(symbol);
+        if (!symbols) return base(symbol);
+        std::string s="(";
+        for (int sub:*symbols) s+=base(sub);
+        return s+")";
+    };
+}
+
+int PatternMacroMachine::num_nonzero(int symbol) const {
+    const std::vector<int>* symbols=this->pattern(symbol);
+    if (!symbols) return this->base_machine->num_nonzero(symbol);
+    int cnt=0;
+    for (int sub:*symbols) cnt+=this->base_machine->num_nonzero(sub);
+    return cnt;
+}
+
+const Transition& PatternMacroMachine::get_trans_object(int symbol_in,int state_in,Dir dir) {
+    const std::vector<int>* symbols=this->pattern(symbol_in);
+    if (!symbols) return this->base_machine->get_trans_object(symbol_in,state_in,dir);
+    uint64_t hash=((uint64_t)symbol_in*this->num_states+state_in)*2+dir;
+    return this->trans_table.get(hash,[&]() {
+        // Like a block, except that the written pattern is interned.
+        int pos=(dir==RIGHT ? 0 : symbols->size()-1);
+        auto [trans,tape]=sim_limited(*this->base_machine,state_in,*symbols,dir,pos);
+        std::tie(trans.symbol_out,trans.num_out)=this->intern(tape);
+        return trans;
+    });
+}
+
+bool parse_macro_stack(const std::string& spec,std::vector<MacroLayer>& layers) {
+    layers.clear();
+    size_t begin=0;
+    while (begin<=spec.size()) {
+        size_t end=std::min(spec.find(',',begin),spec.size());
+        std::string layer=spec.substr(begin,end-begin);
+        if (!layers.empty() && layers.back().pattern) return 0; // not the top layer
+        if (layer=="back") layers.push_back({1,1});
+        else if (layer=="pattern") layers.push_back({0,1,1});
+        else if (layer.starts_with("block") && layer.size()>5 && layer.find_first_not_of("0123456789",5)==std::string::npos) {
+            int block_size=std::stoi(layer.substr(5));
+            if (block_size<1) return 0;
+            layers.push_back({0,block_size});
+        }
+        else return 0;
+        begin=end+1;
     }
-    else {
-        // [0, 1], A, LEFT -> <A(0) 1
-        backsymbol=tape2.at(0);
-        symbol_out=tape2.at(1);
+    return 1;
+}
+
+std::shared_ptr<TuringMachine> make_macro_stack(const SimpleMachine& machine,const std::vector<MacroLayer>& layers) {
+    std::shared_ptr<TuringMachine> top=std::make_shared<SimpleMachine>(machine);
+    for (const MacroLayer& layer:layers) {
+        if (layer.pattern) top=std::make_shared<PatternMacroMachine>(top);
+        else if (layer.backsymbol) top=std::make_shared<BacksymbolMacroMachine>(top);
+        else top=std::make_shared<BlockMacroMachine>(top,layer.block_size);
     }
-    // Update symbol_out and state_out to be backsymbol-style.
-    int state_out=backsymbol*this->num_states+trans.state_out;
-    trans.symbol_out=symbol_out;
-    trans.state_out=state_out;
-    return this->trans_table[hash]=trans;
+    return top;
 }
@@ -1,76 +1,265 @@
 #pragma once
+#include "trans_cache.h"
 #include "transition.h"
+#include <atomic>
 #include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <tuple>
 #include <vector>
 
+struct PatternMacroMachine;
+
 struct TuringMachine {
     int num_states;
     int num_symbols;
+
+    int init_state=0;
+    int init_symbol=0;
+    Dir init_dir=RIGHT;
+
     TuringMachine(int num_states,int num_symbols) :
         num_states{num_states}, num_symbols{num_symbols} {}
+    virtual ~TuringMachine() {}
+
     virtual const Transition& get_trans_object(int symbol_in,int state_in,Dir dir)=0;
+
+    virtual std::function<std::string(int)> symbol_to_string() const=0;
+    virtual std::string head_to_string(int state,Dir dir) const=0;
+
+    // Number of non-blank base symbols in a symbol.
+    virtual int num_nonzero(int symbol) const=0;
+    // Number of non-blank base symbols held in a state (backsymbols).
+    virtual int state_num_nonzero(int state) const=0;
+    // The state of the bottom SimpleMachine, -1 if halted.
+    virtual int base_state(int state) const=0;
+    virtual int base_num_symbols() const=0;
+
+    // For seeding from a base machine configuration (see Simulator::seed):
+    // number of base cells in a symbol,
+    virtual int base_cells() const=0;
+    // number of symbols behind the head that are held in the state,
+    virtual int num_held_symbols() const=0;
+    // and the state holding them (held[0] is nearest to the head), or -1 if
+    // this stack can't be seeded.
+    virtual int make_state(int base_state,const std::vector<int>& held) const=0;
+
+    // The top layer if it compresses repeated patterns, nullptr otherwise.
+    virtual PatternMacroMachine* pattern_machine() {
+        return nullptr;
+    }
 };
 
 // The most general Turing Machine based off of a transition table
 struct SimpleMachine : public TuringMachine {
     std::vector<std::vector<Transition>> ttable;
 
-    int init_state=0;
-    int init_symbol=0;
-    Dir init_dir=RIGHT;
-
-    std::vector<std::string> symbol_to_string;
-
     SimpleMachine(std::vector<std::vector<Transition>> ttable, int num_states, int num_symbols) :
-        TuringMachine(num_states, num_symbols), ttable{ttable} {
-            for (int i=0; i<num_states; i++) symbol_to_string.push_back({(char)('0'+i)});
-        }
+        TuringMachine(num_states, num_symbols), ttable{ttable} {}
 
     const Transition& get_trans_object(int symbol_in,int state_in,Dir dir) {
         return this->ttable.at(state_in).at(symbol_in);
     }
+
+    std::function<std::string(int)> symbol_to_string() const;
+    std::string head_to_string(int state,Dir dir) const;
+    int num_nonzero(int symbol) const {
+        return symbol!=0;
+    }
+    int state_num_nonzero(int state) const {
+        return 0;
+    }
+    int base_state(int state) const {
+        return state;
+    }
+    int base_num_symbols() const {
+        return this->num_symbols;
+    }
+    int base_cells() const {
+        return 1;
+    }
+    int num_held_symbols() const {
+        return 0;
+    }
+    int make_state(int base_state,const std::vector<int>& held) const {
+        return base_state;
+    }
 };
 
-// Parse TMs in standard text format.
+// Build a transition table. Transitions not listed are UNDEFINED.
+// quints are (state_in,symbol_in,symbol_out,dir_out,state_out), state_out=-1 halts.
+SimpleMachine tmFromQuintuples(
+    const std::vector<std::tuple<int,int,int,Dir,int>>& quints,
+    int num_states,
+    int num_symbols
+);
+
+// Parse TMs in standard text format, e.g. 1RB1LA_1LA1RZ. Returns nullopt if
+// the text is malformed: rows of different lengths, or a transition that
+// isn't "---" or symbol, L/R, state.
+std::optional<SimpleMachine> tryParseTM(const std::string& line);
+// For text known to be valid.
 SimpleMachine parseTM(const std::string& line);
 
+// Inverse of parseTM. Halting transitions go to state Z.
+std::string tmToString(const SimpleMachine& machine);
+
 // A derivative Turing Machine which simulates another machine clumping k-symbols together into a block-symbol
 struct BlockMacroMachine : public TuringMachine {
-    SimpleMachine base_machine; // todo: support other machines
+    std::shared_ptr<TuringMachine> base_machine;
     int block_size;
 
-    // A lazy evaluation hashed macro transition table
-    std::map<int,Transition> trans_table;
+    // A lazy evaluation hashed macro transition table, shareable between threads
+    TransCache trans_table;
 
-    int init_state;
-    int init_symbol;
-    Dir init_dir;
-
-    BlockMacroMachine(SimpleMachine base_machine, int block_size);
+    BlockMacroMachine(std::shared_ptr<TuringMachine> base_machine, int block_size);
 
     std::function<std::string(int)> symbol_to_string() const;
+    std::string head_to_string(int state,Dir dir) const {
+        return this->base_machine->head_to_string(state,dir);
+    }
+    int num_nonzero(int symbol) const;
+    int state_num_nonzero(int state) const {
+        return this->base_machine->state_num_nonzero(state);
+    }
+    int base_state(int state) const {
+        return this->base_machine->base_state(state);
+    }
+    int base_num_symbols() const {
+        return this->base_machine->base_num_symbols();
+    }
+    int base_cells() const {
+        return this->block_size*this->base_machine->base_cells();
+    }
+    int num_held_symbols() const {
+        return 0;
+    }
+    int make_state(int base_state,const std::vector<int>& held) const {
+        // Blocks over held symbols don't line up with the base cells.
+        if (this->base_machine->num_held_symbols()) return -1;
+        return this->base_machine->make_state(base_state,held);
+    }
 
     const Transition& get_trans_object(int symbol_in,int state_in,Dir dir);
 };
 
+// A derivative Turing Machine which keeps the symbol behind the head in its state.
+// State backsymbol*base_num_states+s is base state s holding backsymbol.
+// base_num_states is one more than the base machine's, so that base state -1
+// (halt) fits too: backsymbol*base_num_states-1.
 struct BacksymbolMacroMachine : public TuringMachine {
-    BlockMacroMachine base_machine; // todo: support other machines
+    std::shared_ptr<TuringMachine> base_machine;
+    int base_num_states;
 
-    // A lazy evaluation hashed macro transition table
-    std::map<std::pair<int,int>,Transition> trans_table;
+    // A lazy evaluation hashed macro transition table, shareable between threads
+    TransCache trans_table;
 
-    int init_state;
-    int init_symbol;
-    Dir init_dir;
+    BacksymbolMacroMachine(std::shared_ptr<TuringMachine> base_machine);
 
-    BacksymbolMacroMachine(BlockMacroMachine base_machine);
+    // (backsymbol,base state) of a state.
+    std::pair<int,int> split_state(int state) const;
 
-    std::string head_to_string(int state,Dir dir) const;
     std::function<std::string(int)> symbol_to_string() const {
-        return this->base_machine.symbol_to_string();
+        return this->base_machine->symbol_to_string();
+    }
+    std::string head_to_string(int state,Dir dir) const;
+    int num_nonzero(int symbol) const {
+        return this->base_machine->num_nonzero(symbol);
+    }
+    int state_num_nonzero(int state) const;
+    int base_state(int state) const {
+        return this->base_machine->base_state(this->split_state(state).second);
+    }
+    int base_num_symbols() const {
+        return this->base_machine->base_num_symbols();
     }
+    int base_cells() const {
+        return this->base_machine->base_cells();
+    }
+    int num_held_symbols() const {
+        return this->base_machine->num_held_symbols()+1;
+    }
+    int make_state(int base_state,const std::vector<int>& held) const;
 
     const Transition& get_trans_object(int symbol_in,int state_in,Dir dir);
 };
+
+// A derivative Turing Machine whose symbols are the base machine's plus
+// patterns: sequences of 2 to MAX_PATTERN_SYMBOLS base symbols, left to
+// right, that act like one block of variable size. Patterns are added by the
+// simulators when a sequence of blocks repeats (see ChainTape::compress_patterns)
+// and by transitions on patterns. Symbol ids from base_machine->num_symbols
+// on are patterns. Must be the top layer, since the number of symbols grows.
+// A pattern is never a repetition of a shorter word: a transition that writes
+// k copies of a word writes the word with num_out=k instead.
+const int MAX_PATTERN_SYMBOLS=8;
+struct PatternMacroMachine : public TuringMachine {
+    std::shared_ptr<TuringMachine> base_machine;
+
+    // A lazy evaluation hashed macro transition table, shareable between threads
+    TransCache trans_table;
+
+    // Interned patterns. Pattern i is in chunk bit_width(i+1)-1, which holds
+    // 2^c patterns and never moves, so pattern() reads them without a lock
+    // once num_patterns says they are there. intern appends under
+    // patterns_mutex, which also guards pattern_ids.
+    mutable std::mutex patterns_mutex;
+    std::unique_ptr<std::vector<int>[]> pattern_chunks[31];
+    std::atomic<int> num_patterns=0;
+    std::map<std::vector<int>,int> pattern_ids;
+
+    PatternMacroMachine(std::shared_ptr<TuringMachine> base_machine);
+
+    // The symbol for a sequence of base symbols and how many copies of it the
+    // sequence is: {pattern of the shortest repeating word, repeats}, or
+    // {symbol,n} for n copies of one base symbol.
+    std::pair<int,int> intern(const std::vector<int>& symbols);
+    // The base symbols of a pattern, nullptr for base symbols.
+    const std::vector<int>* pattern(int symbol) const;
+
+    std::function<std::string(int)> symbol_to_string() const;
+    std::string head_to_string(int state,Dir dir) const {
+        return this->base_machine->head_to_string(state,dir);
+    }
+    int num_nonzero(int symbol) const;
+    int state_num_nonzero(int state) const {
+        return this->base_machine->state_num_nonzero(state);
+    }
+    int base_state(int state) const {
+        return this->base_machine->base_state(state);
+    }
+    int base_num_symbols() const {
+        return this->base_machine->base_num_symbols();
+    }
+    int base_cells() const {
+        return this->base_machine->base_cells();
+    }
+    int num_held_symbols() const {
+        return this->base_machine->num_held_symbols();
+    }
+    int make_state(int base_state,const std::vector<int>& held) const {
+        return this->base_machine->make_state(base_state,held);
+    }
+    PatternMacroMachine* pattern_machine() {
+        return this;
+    }
+
+    const Transition& get_trans_object(int symbol_in,int state_in,Dir dir);
+};
+
+// One layer of a macro machine stack.
+struct MacroLayer {
+    bool backsymbol=0;
+    int block_size=1; // if !backsymbol
+    bool pattern=0; // a PatternMacroMachine instead
+};
+
+// Parse a stack like "block2,block3,back", bottom layer first. A "pattern"
+// layer may only come last. False if it is malformed.
+bool parse_macro_stack(const std::string& spec,std::vector<MacroLayer>& layers);
+
+// Build layers on top of a machine. No layers gives the machine itself.
+std::shared_ptr<TuringMachine> make_macro_stack(const SimpleMachine& machine,const std::vector<MacroLayer>& layers);
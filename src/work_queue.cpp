@@ -0,0 +1,176 @@
+#include "work_queue.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+WorkQueue::WorkQueue(const std::string& dir,double lease_timeout) :
+    dir{dir},
+    lease_timeout{lease_timeout} {}
+
+// "lease-<begin>-<end>" with zero padding, so file names sort by begin.
+std::string lease_name(long long begin,long long end) {
+    char name[64];
+    snprintf(name,sizeof(name),"lease-%012lld-%012lld",begin,end);
+    return name;
+}
+
+bool parse_lease_name(const std::string& name,Lease& lease) {
+    lease.name=name;
+    return sscanf(name.c_str(),"lease-%lld-%lld",&lease.begin,&lease.end)==2;
+}
+
+// Sorted lease file names in a subdirectory.
+std::vector<std::string> list_leases(const std::string& path) {
+    std::vector<std::string> names;
+    std::error_code error;
+    for (auto& entry:std::filesystem::directory_iterator(path,error)) {
+        std::string name=entry.path().filename().string();
+        if (name.starts_with("lease-")) names.push_back(name);
+    }
+    std::sort(names.begin(),names.end());
+    return names;
+}
+
+bool WorkQueue::create(const std::string& input_format,const std::string& input,long long num_machines,long long lease_size) {
+    std::error_code error;
+    if (std::filesystem::exists(this->dir+"/queue.info")) return 0;
+    for (const char* subdir:{"pending","claimed","done","results"}) {
+        std::filesystem::create_directories(this->dir+"/"+subdir,error);
+        if (error) return 0;
+    }
+    for (long long begin=0; begin<num_machines; begin+=lease_size) {
+        std::string path=this->dir+"/pending/"+lease_name(begin,std::min(num_machines,begin+lease_size));
+        int fd=open(path.c_str(),O_WRONLY|O_CREAT,0644);
+        if (fd<0) return 0;
+        close(fd);
+    }
+    // Written last: workers don't start on a half made queue.
+    std::string tmp_path=this->dir+"/queue.info.tmp";
+    {
+        std::ofstream info(tmp_path);
+        info<<"input_format="<<input_format<<"\n";
+        info<<"input="<<std::filesystem::absolute(input).string()<<"\n";
+        info<<"num_machines="<<num_machines<<"\n";
+        if (!info) return 0;
+    }
+    if (rename(tmp_path.c_str(),(this->dir+"/queue.info").c_str())!=0) return 0;
+    this->input_format=input_format;
+    this->input=std::filesystem::absolute(input).string();
+    this->num_machines=num_machines;
+    return 1;
+}
+
+bool WorkQueue::load_info() {
+    std::ifstream info(this->dir+"/queue.info");
+    if (!info) return 0;
+    std::string line;
+    while (std::getline(info,line)) {
+        size_t eq=line.find('=');
+        if (eq==std::string::npos) continue;
+        std::string key=line.substr(0,eq),value=line.substr(eq+1);
+        if (key=="input_format") this->input_format=value;
+        else if (key=="input") this->input=value;
+        else if (key=="num_machines") this->num_machines=std::stoll(value);
+    }
+    return !this->input_format.empty() && !this->input.empty();
+}
+
+std::optional<Lease> WorkQueue::claim(const std::string& worker_id) {
+    for (const std::string& name:list_leases(this->dir+"/pending")) {
+        Lease lease;
+        if (!parse_lease_name(name,lease)) continue;
+        lease.claimed_name=name+"@"+worker_id+"-"+std::to_string(++this->num_claims);
+        std::string from=this->dir+"/pending/"+name,to=this->dir+"/claimed/"+lease.claimed_name;
+        // Another worker may win this one, then try the next.
+        if (rename(from.c_str(),to.c_str())!=0) continue;
+        this->heartbeat(lease);
+        return lease;
+    }
+    return std::nullopt;
+}
+
+void WorkQueue::heartbeat(const Lease& lease) {
+    // Sets mtime to now. Fails if the lease was reclaimed, even if another
+    // worker has claimed it since, because that claim has another name.
+    utimensat(AT_FDCWD,(this->dir+"/claimed/"+lease.claimed_name).c_str(),nullptr,0);
+}
+
+bool WorkQueue::finish(const Lease& lease) {
+    std::string from=this->dir+"/claimed/"+lease.claimed_name,to=this->dir+"/done/"+lease.name;
+    return rename(from.c_str(),to.c_str())==0;
+}
+
+int WorkQueue::reclaim_expired() {
+    int num_reclaimed=0;
+    time_t now=time(nullptr);
+    for (const std::string& claimed_name:list_leases(this->dir+"/claimed")) {
+        std::string name=claimed_name.substr(0,claimed_name.find('@'));
+        std::string from=this->dir+"/claimed/"+claimed_name,to=this->dir+"/pending/"+name;
+        struct stat st;
+        if (stat(from.c_str(),&st)!=0 || now-st.st_mtime<=this->lease_timeout) continue;
+        if (rename(from.c_str(),to.c_str())==0) num_reclaimed++;
+    }
+    return num_reclaimed;
+}
+
+long long WorkQueue::count(const std::string& subdir) const {
+    return list_leases(this->dir+"/"+subdir).size();
+}
+
+std::string WorkQueue::results_path(const std::string& worker_id) const {
+    return this->dir+"/results/"+worker_id+".tsv";
+}
+
+long long WorkQueue::merge() const {
+    // Keys are machine indices. Sort them as numbers.
+    std::map<long long,std::string> lines;
+    std::error_code error;
+    for (auto& entry:std::filesystem::directory_iterator(this->dir+"/results",error)) {
+        if (entry.path().extension()!=".tsv") continue;
+        std::ifstream in(entry.path());
+        std::string line;
+        // A line without its newline is a partial write of a killed worker.
+        while (std::getline(in,line) && !in.eof()) {
+            size_t tab=line.find('\t');
+            if (tab==std::string::npos) continue;
+            lines.emplace(std::stoll(line.substr(0,tab)),line);
+        }
+    }
+    std::string tmp_path=this->dir+"/results.tsv.tmp";
+    {
+        std::ofstream out(tmp_path);
+        for (auto& [key,line]:lines) out<<line<<"\n";
+        if (!out) return -1;
+    }
+    if (rename(tmp_path.c_str(),(this->dir+"/results.tsv").c_str())!=0) return -1;
+    return lines.size();
+}
+
+LeaseKeeper::LeaseKeeper(WorkQueue& queue,const Lease& lease) :
+        queue{queue},
+        lease{lease} {
+    this->thread=std::thread([this]() {
+        // Renew several times per timeout, checking for stop often.
+        auto interval=std::chrono::duration<double>(this->queue.lease_timeout/4);
+        auto next=std::chrono::steady_clock::now()+interval;
+        while (!this->stop) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            if (std::chrono::steady_clock::now()<next) continue;
+            this->queue.heartbeat(this->lease);
+            next+=std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval);
+        }
+    });
+}
+
+LeaseKeeper::~LeaseKeeper() {
+    this->stop=true;
+    this->thread.join();
+}
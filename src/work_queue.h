@@ -0,0 +1,83 @@
+#pragma once
+#include <atomic>
+#include <optional>
+#include <string>
+#include <thread>
+
+// A range [begin,end) of machine indices that one worker runs at a time.
+struct Lease {
+    std::string name; // file name in pending/ and done/
+    // File name in claimed/: name@<worker id>-<claim number>, so a claim
+    // that was reclaimed and claimed again is never mistaken for this one.
+    std::string claimed_name;
+    long long begin=0,end=0;
+};
+
+// A work queue in a directory, shared by worker processes on any host that
+// sees the same filesystem. No other coordination service is needed.
+//   queue.info   input file, its format and number of machines
+//   pending/     one empty file per unclaimed lease
+//   claimed/     leases being worked on, named after their owner. The file's
+//                mtime is the owner's heartbeat.
+//   done/        finished leases
+//   results/     one results file per worker
+// A claim is a rename from pending/ to claimed/, which only one worker can win.
+// A claimed lease whose heartbeat is older than lease_timeout is moved back
+// to pending/ by any worker. Its first owner can then neither renew nor
+// finish it. If it ran the lease to the end anyway, both results are kept
+// and merge() drops the duplicates.
+struct WorkQueue {
+    std::string dir;
+    double lease_timeout;
+
+    // From queue.info
+    std::string input_format; // "seed-db" or "machines"
+    std::string input;
+    long long num_machines=0;
+
+    long long num_claims=0; // by this process
+
+    WorkQueue(const std::string& dir,double lease_timeout=60);
+
+    // Coordinator: make a new queue splitting [0,num_machines) into leases.
+    // Fails if dir already has a queue.
+    bool create(const std::string& input_format,const std::string& input,long long num_machines,long long lease_size);
+
+    // Read queue.info. Workers call this first.
+    bool load_info();
+
+    // Claim a pending lease for worker_id, or nullopt if there are none.
+    std::optional<Lease> claim(const std::string& worker_id);
+
+    // Renew a claimed lease. Does nothing if it expired and was reclaimed.
+    void heartbeat(const Lease& lease);
+
+    // Mark a claimed lease as done. False if it expired and was reclaimed.
+    bool finish(const Lease& lease);
+
+    // Move expired claimed leases back to pending/. Returns how many.
+    int reclaim_expired();
+
+    // Number of leases in pending/, claimed/ or done/.
+    long long count(const std::string& subdir) const;
+
+    std::string results_path(const std::string& worker_id) const;
+
+    // Combine the worker results files into dir/results.tsv with one line
+    // per key, in key order. Returns the number of lines.
+    long long merge() const;
+};
+
+// Renews a lease from a background thread while it is alive, so a single
+// slow machine doesn't let the lease expire.
+struct LeaseKeeper {
+    WorkQueue& queue;
+    Lease lease;
+    std::atomic<bool> stop=false;
+    std::thread thread;
+
+    LeaseKeeper(WorkQueue& queue,const Lease& lease);
+    ~LeaseKeeper();
+    LeaseKeeper(const LeaseKeeper&)=delete;
+    LeaseKeeper& operator=(const LeaseKeeper&)=delete;
+};
@@ -5,6 +5,21 @@
 #include <optional>
 #include <string>
 
+// Threads for arithmetic on huge numbers, 1 to keep it all on the calling
+// thread. Set once at startup with set_arith_threads. In parallel_arith.cpp.
+extern int num_arith_threads;
+void set_arith_threads(int num_threads);
+// Products with both operands at least this many limbs go to parallel_mul,
+// if there are at least PARALLEL_MUL_THREADS threads for its three pieces.
+const slong PARALLEL_MUL_LIMBS=1<<15;
+const int PARALLEL_MUL_THREADS=3;
+// out=a*b with the operands split into pieces multiplied on separate threads.
+void parallel_mul(fmpz_t out,const fmpz_t a,const fmpz_t b);
+inline bool use_parallel_mul(const fmpz_t a,const fmpz_t b) {
+    return num_arith_threads>=PARALLEL_MUL_THREADS && COEFF_IS_MPZ(*a) && COEFF_IS_MPZ(*b) &&
+        fmpz_size(a)>=PARALLEL_MUL_LIMBS && fmpz_size(b)>=PARALLEL_MUL_LIMBS;
+}
+
 struct fmpz_class {
     fmpz_t num;
 
@@ -63,7 +78,8 @@ public:
     fmpz_class operator*(const fmpz_class& other) const {
         fmpz_t res;
         fmpz_init(res);
-        fmpz_mul(res,num,other.num);
+        if (use_parallel_mul(num,other.num)) parallel_mul(res,num,other.num);
+        else fmpz_mul(res,num,other.num);
         return {res};
     }
     fmpz_class operator*(slong other) const {
@@ -84,10 +100,55 @@ public:
         fmpz_fdiv_q_si(res,num,other);
         return {res};
     }
+
+    // In-place versions. These reuse the existing limbs instead of making a temporary.
+    fmpz_class& operator+=(const fmpz_class& other) {
+        fmpz_add(num,num,other.num);
+        return *this;
+    }
+    fmpz_class& operator+=(slong other) {
+        fmpz_add_si(num,num,other);
+        return *this;
+    }
+    fmpz_class& operator-=(const fmpz_class& other) {
+        fmpz_sub(num,num,other.num);
+        return *this;
+    }
+    fmpz_class& operator-=(slong other) {
+        fmpz_sub_si(num,num,other);
+        return *this;
+    }
+    fmpz_class& operator*=(const fmpz_class& other) {
+        if (use_parallel_mul(num,other.num)) parallel_mul(num,num,other.num);
+        else fmpz_mul(num,num,other.num);
+        return *this;
+    }
+    fmpz_class& operator*=(slong other) {
+        fmpz_mul_si(num,num,other);
+        return *this;
+    }
+    fmpz_class& operator/=(const fmpz_class& other) {
+        fmpz_fdiv_q(num,num,other.num);
+        return *this;
+    }
+    fmpz_class& operator/=(slong other) {
+        fmpz_fdiv_q_si(num,num,other);
+        return *this;
+    }
+    // this+=a*b, this-=a*b without materializing a*b
+    void add_mul(const fmpz_class& a,const fmpz_class& b) {
+        if (use_parallel_mul(a.num,b.num)) fmpz_add(num,num,(a*b).num);
+        else fmpz_addmul(num,a.num,b.num);
+    }
+    void sub_mul(const fmpz_class& a,const fmpz_class& b) {
+        if (use_parallel_mul(a.num,b.num)) fmpz_sub(num,num,(a*b).num);
+        else fmpz_submul(num,a.num,b.num);
+    }
+
     std::string get_str() const {
         char* p=fmpz_get_str(nullptr,10,num);
         std::string out(p);
-        free(p);
+        flint_free(p);
         return out;
     }
 };
@@ -156,12 +217,86 @@ struct XInteger {
         return {this->num.value()/other.num.value()};
     }
 
+    // In-place versions, used on hot paths with big numbers.
+    // Unlike operator-, these don't check for negative intermediate values.
+    // The caller makes sure the final value is >=0.
+    XInteger& operator+=(int other) {
+        if (!this->is_inf()) this->num.value()+=other;
+        return *this;
+    }
+    XInteger& operator+=(const XInteger& other) {
+        if (other.is_inf()) this->num.reset();
+        else if (!this->is_inf()) this->num.value()+=other.num.value();
+        return *this;
+    }
+    XInteger& operator-=(int other) {
+        if (!this->is_inf()) this->num.value()-=other;
+        return *this;
+    }
+    XInteger& operator-=(const XInteger& other) {
+        if (other.is_inf()) assert(0);
+        if (!this->is_inf()) this->num.value()-=other.num.value();
+        return *this;
+    }
+    XInteger& operator*=(int other) {
+        if (other==0) this->num=mpz0;
+        else if (!this->is_inf()) this->num.value()*=other;
+        return *this;
+    }
+    XInteger& operator*=(const XInteger& other) {
+        if (this->num==mpz0 || other.num==mpz0) this->num=mpz0;
+        else if (other.is_inf()) this->num.reset();
+        else if (!this->is_inf()) this->num.value()*=other.num.value();
+        return *this;
+    }
+    XInteger& operator/=(int other) {
+        if (other==0) assert(0);
+        if (!this->is_inf()) this->num.value()/=other;
+        return *this;
+    }
+    XInteger& operator/=(const XInteger& other) {
+        if (other.is_inf() || other.num==mpz0) assert(0);
+        if (!this->is_inf()) this->num.value()/=other.num.value();
+        return *this;
+    }
+    // this+=a*b
+    void add_mul(const XInteger& a,const XInteger& b) {
+        if (a.num==mpz0 || b.num==mpz0) return;
+        if (a.is_inf() || b.is_inf()) this->num.reset();
+        else if (!this->is_inf()) this->num.value().add_mul(a.num.value(),b.num.value());
+    }
+    // this-=a*b
+    void sub_mul(const XInteger& a,const XInteger& b) {
+        if (a.num==mpz0 || b.num==mpz0) return;
+        if (a.is_inf() || b.is_inf()) assert(0);
+        if (!this->is_inf()) this->num.value().sub_mul(a.num.value(),b.num.value());
+    }
+
     std::string to_string() const {
         if (this->is_inf()) return "inf";
         std::string out=this->num.value().get_str();
         if (out.size()<=50) return out;
         return "(sz="+std::to_string(out.size())+":"+out.substr(0,25)+"..."+out.substr(out.size()-25)+")";
     }
+
+    // Exact value if it is short, otherwise "sz=<number of digits>:<first 9 digits>".
+    // Unlike to_string, this never converts the whole number to decimal.
+    std::string to_short_string() const {
+        if (this->is_inf()) return "inf";
+        const fmpz_t& value=this->num.value().num;
+        if (fmpz_bits(value)<=160) return this->num.value().get_str();
+        // sizeinbase is exact or one too many, which leaves 8 digits in lead.
+        long long digits=fmpz_sizeinbase(value,10);
+        fmpz_class power(10),lead;
+        fmpz_pow_ui(power.num,power.num,digits-9);
+        fmpz_tdiv_q(lead.num,value,power.num);
+        if (fmpz_cmpabs(lead.num,fmpz_class(100000000).num)<0) {
+            digits--;
+            fmpz_divexact_ui(power.num,power.num,10);
+            fmpz_tdiv_q(lead.num,value,power.num);
+        }
+        return "sz="+std::to_string(digits)+":"+lead.get_str();
+    }
 };
 
 // supports expressions like: (Sum_i coefficient_i*variable_i) + num
@@ -174,7 +309,7 @@ struct VarPlusXInteger {
         for (auto& p:this->var) {
             auto it=assignment.find(p.first);
             assert(it!=assignment.end());
-            out=out+p.second*it->second;
+            out.add_mul(p.second,it->second);
         }
         return out;
     }